@@ -0,0 +1,325 @@
+//
+// bench.cpp
+//
+// ray-bench: renders a fixed list of the public scenes at fixed sizes and
+// thread counts, records timings and counters as JSON, and compares them
+// against a stored baseline.
+//
+//   ray-bench [--scenes DIR] [--list FILE] [--out FILE] [--baseline FILE]
+//             [--threshold FRACTION] [--repeat N] [--only SUBSTRING]
+//
+// Every case runs in its own child process, so peak RSS is per case and
+// nothing one scene loads can speed up the next.  Of the repeats, the run
+// with the shortest wall time is kept.  A case has regressed when its
+// trace time, build time or BVH node visits grew by more than the
+// threshold over the baseline; ray-bench then exits with status 1.
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Renderer.h"
+#include "ui/json.hpp"
+
+using Json = nlohmann::json;
+using namespace std;
+
+#ifndef BENCH_SCENE_DIR
+#define BENCH_SCENE_DIR "scenes"
+#endif
+#ifndef BENCH_LIST
+#define BENCH_LIST "scenes.json"
+#endif
+
+namespace {
+
+struct Case {
+	string name;
+	string scene;
+	int width;
+	int threads;
+	string settings;
+};
+
+// Peak resident set size of this process in kilobytes
+long peakRss()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+}
+
+// Runs in the child: load, render and measure one case.
+Json measure(const Case& c, const string& sceneDir)
+{
+	Renderer renderer;
+	Json settings = c.settings.empty() ? Json::object() : Json::parse(c.settings);
+	settings["threads"] = c.threads;
+	if (!renderer.configure(settings.dump()))
+		return {{"error", renderer.error()}};
+
+	auto start = chrono::steady_clock::now();
+	if (!renderer.loadScene(sceneDir + "/" + c.scene))
+		return {{"error", renderer.error()}};
+	int height = (int)(c.width / renderer.aspectRatio() + 0.5);
+	vector<unsigned char> image((size_t)c.width * height * 3);
+	if (!renderer.render(c.width, height, image.data()))
+		return {{"error", renderer.error()}};
+	double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	const Renderer::Stats& stats = renderer.stats();
+	return {{"height", height},
+	        {"parse_ms", stats.parseSeconds * 1000.0},
+	        {"build_ms", stats.buildSeconds * 1000.0},
+	        {"trace_ms", stats.traceSeconds * 1000.0},
+	        {"wall_ms", wall * 1000.0},
+	        {"rays", stats.rays},
+	        {"rays_per_sec", stats.traceSeconds > 0.0 ? stats.rays / stats.traceSeconds : 0.0},
+	        {"node_visits", stats.nodeVisits},
+	        {"peak_rss_kb", peakRss()}};
+}
+
+Json runCase(const Case& c, const string& sceneDir)
+{
+	int fds[2];
+	if (pipe(fds) != 0)
+		return {{"error", "pipe failed"}};
+	fflush(nullptr);
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return {{"error", "fork failed"}};
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		Json result;
+		try {
+			result = measure(c, sceneDir);
+		} catch (Json::exception& e) {
+			result = {{"error", string("bad settings: ") + e.what()}};
+		}
+		string text = result.dump();
+		const char* p = text.data();
+		size_t left = text.size();
+		while (left > 0) {
+			ssize_t n = write(fds[1], p, left);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			p += n;
+			left -= n;
+		}
+		_exit(0);
+	}
+
+	close(fds[1]);
+	string text;
+	char buf[4096];
+	for (;;) {
+		ssize_t n = read(fds[0], buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		text.append(buf, n);
+	}
+	close(fds[0]);
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || text.empty())
+		return {{"error", "renderer crashed"}};
+	return Json::parse(text);
+}
+
+// Percent change from base to now, for the report
+string change(double base, double now)
+{
+	char buf[32];
+	if (base <= 0.0)
+		return "n/a";
+	snprintf(buf, sizeof(buf), "%+.1f%%", (now - base) / base * 100.0);
+	return buf;
+}
+
+void usage(const char* prog)
+{
+	cerr << "usage: " << prog << " [options]" << endl
+	     << "  --scenes <DIR>       extracted public scenes (default " << BENCH_SCENE_DIR << ")" << endl
+	     << "  --list <FILE>        scene list (default " << BENCH_LIST << ")" << endl
+	     << "  --out <FILE>         write results as JSON" << endl
+	     << "  --baseline <FILE>    compare with results from an earlier run" << endl
+	     << "  --threshold <#>      allowed slowdown as a fraction (default 0.10)" << endl
+	     << "  --repeat <#>         runs per case, fastest kept (default from the list)" << endl
+	     << "  --only <TEXT>        only cases whose name contains TEXT" << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+	string sceneDir = BENCH_SCENE_DIR;
+	string listFile = BENCH_LIST;
+	string outFile, baselineFile, only;
+	double threshold = 0.10;
+	int repeat = 0;
+
+	for (int a = 1; a < argc; a++) {
+		string arg = argv[a];
+		bool hasValue = a + 1 < argc;
+		if (arg == "--scenes" && hasValue)
+			sceneDir = argv[++a];
+		else if (arg == "--list" && hasValue)
+			listFile = argv[++a];
+		else if (arg == "--out" && hasValue)
+			outFile = argv[++a];
+		else if (arg == "--baseline" && hasValue)
+			baselineFile = argv[++a];
+		else if (arg == "--threshold" && hasValue)
+			threshold = atof(argv[++a]);
+		else if (arg == "--repeat" && hasValue)
+			repeat = atoi(argv[++a]);
+		else if (arg == "--only" && hasValue)
+			only = argv[++a];
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	vector<Case> cases;
+	try {
+		ifstream ifs(listFile);
+		if (!ifs) {
+			cerr << "Unable to read scene list '" << listFile << "'" << endl;
+			return 2;
+		}
+		Json list = Json::parse(ifs);
+		if (repeat <= 0)
+			repeat = list.value("repeat", 1);
+		for (int threads : list.at("threads")) {
+			for (const auto& entry : list.at("scenes")) {
+				Case c;
+				c.scene = entry.at("scene").get<string>();
+				c.width = entry.value("width", 512);
+				c.threads = threads;
+				if (entry.count("settings"))
+					c.settings = entry["settings"].dump();
+				c.name = c.scene + "@" + to_string(c.width) + "/t" +
+				         to_string(threads);
+				if (only.empty() || c.name.find(only) != string::npos)
+					cases.push_back(c);
+			}
+		}
+	} catch (Json::exception& e) {
+		cerr << "Bad scene list '" << listFile << "': " << e.what() << endl;
+		return 2;
+	}
+
+	Json baseline;
+	if (!baselineFile.empty()) {
+		ifstream ifs(baselineFile);
+		try {
+			Json stored = Json::parse(ifs);
+			for (const auto& c : stored.at("cases"))
+				baseline[c.at("name").get<string>()] = c;
+		} catch (Json::exception& e) {
+			cerr << "Bad baseline '" << baselineFile << "': " << e.what() << endl;
+			return 2;
+		}
+	}
+
+	Json results = Json::array();
+	int failed = 0, regressed = 0;
+	for (const auto& c : cases) {
+		Json best;
+		long peak = 0;
+		for (int r = 0; r < repeat; r++) {
+			Json run = runCase(c, sceneDir);
+			if (run.count("error")) {
+				best = run;
+				break;
+			}
+			peak = max(peak, run.value("peak_rss_kb", 0L));
+			if (best.is_null() || run["wall_ms"].get<double>() < best["wall_ms"].get<double>())
+				best = run;
+		}
+		best["name"] = c.name;
+		best["scene"] = c.scene;
+		best["width"] = c.width;
+		best["threads"] = c.threads;
+		if (best.count("error")) {
+			cout << c.name << ": " << best["error"].get<string>() << endl;
+			failed++;
+			results.push_back(best);
+			continue;
+		}
+		best["peak_rss_kb"] = peak;
+
+		char line[256];
+		snprintf(line, sizeof(line),
+		         "%-34s build %8.1f ms  trace %9.1f ms  %8.0f krays/s  %6ld MB",
+		         c.name.c_str(), best["build_ms"].get<double>(),
+		         best["trace_ms"].get<double>(),
+		         best["rays_per_sec"].get<double>() / 1000.0, peak / 1024);
+		cout << line;
+
+		if (baseline.count(c.name) && !baseline[c.name].count("error")) {
+			const Json& base = baseline[c.name];
+			string why;
+			for (const char* metric : {"trace_ms", "build_ms", "node_visits"}) {
+				double was = base.value(metric, 0.0);
+				double now = best.value(metric, 0.0);
+				// Times under a millisecond are mostly noise
+				double slack = metric[0] == 'n' ? 0.0 : 1.0;
+				if (now > was * (1.0 + threshold) + slack)
+					why += string(why.empty() ? "" : ", ") + metric + " " + change(was, now);
+			}
+			cout << "  trace " << change(base.value("trace_ms", 0.0), best["trace_ms"].get<double>());
+			if (!why.empty()) {
+				cout << "  REGRESSED: " << why;
+				best["regressed"] = why;
+				regressed++;
+			}
+		}
+		cout << endl;
+		results.push_back(best);
+	}
+
+	if (!outFile.empty()) {
+		Json out = {{"list", listFile},
+		            {"repeat", repeat},
+		            {"hardware_threads", thread::hardware_concurrency()},
+		            {"cases", results}};
+		ofstream ofs(outFile);
+		ofs << out.dump(1, '\t') << endl;
+		if (!ofs) {
+			cerr << "Unable to write '" << outFile << "'" << endl;
+			return 2;
+		}
+	}
+
+	if (failed)
+		cout << failed << " case(s) failed" << endl;
+	if (regressed)
+		cout << regressed << " case(s) regressed by more than "
+		     << threshold * 100.0 << "%" << endl;
+	return failed || regressed ? 1 : 0;
+}
@@ -0,0 +1,461 @@
+//
+// kernels.cpp
+//
+// ray-kernels: times the intersection kernels on their own, away from
+// shading and scene traversal.  Every target gets the same deterministic
+// batch of rays, generated from a fixed seed, so runs and variants can be
+// compared directly.
+//
+//   ray-kernels [--rays N] [--repeat N] [--seed N] [--only TEXT]
+//               [--json FILE]
+//
+// Each target is measured with the tracer's own code (variant
+// "reference") and with any alternative kernels registered for it below,
+// e.g. the same algorithm in float instead of double.  For every variant
+// the report gives nanoseconds per ray, the hit rate, and how often its
+// answer (hit or miss, and t) agrees with the reference.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+
+#include "SceneObjects/Box.h"
+#include "SceneObjects/Cone.h"
+#include "SceneObjects/Cylinder.h"
+#include "SceneObjects/Sphere.h"
+#include "SceneObjects/Square.h"
+#include "SceneObjects/Torus.h"
+#include "SceneObjects/trimesh.h"
+#include "scene/bbox.h"
+#include "scene/ray.h"
+#include "scene/scene.h"
+#include "ui/TraceUI.h"
+#include "ui/json.hpp"
+
+using Json = nlohmann::json;
+using namespace std;
+
+extern TraceUI* traceUI;
+
+namespace {
+
+// The kernels read a few settings (and report errors) through traceUI.
+class BenchUI : public TraceUI {
+public:
+	int run() { return 0; }
+	void alert(const string& msg) { cerr << msg << endl; }
+};
+
+// One ray of a batch, with copies of its data in the layouts the
+// alternative kernels want.
+struct BenchRay {
+	glm::dvec3 p, d;
+	double pd[3], invd[3];
+	float pf[3], invf[3];
+};
+
+// Answer of a kernel for one ray; t is only meaningful for hits.
+struct Hit {
+	bool hit;
+	double t;
+};
+
+struct Result {
+	string target;
+	string variant;
+	double nsPerRay;
+	double hitRate;
+	double agreement;
+	double nodesPerRay;
+};
+
+// Rays start on a sphere of radius 4 and aim at random points of the cube
+// [-spread, spread]^3, so objects in the unit cube see a mix of hits,
+// grazes and misses.
+vector<BenchRay> makeRays(size_t n, unsigned int seed, double spread)
+{
+	mt19937_64 rng(seed);
+	uniform_real_distribution<double> u(-1.0, 1.0);
+	vector<BenchRay> rays(n);
+	for (auto& r : rays) {
+		glm::dvec3 p;
+		do {
+			p = glm::dvec3(u(rng), u(rng), u(rng));
+		} while (glm::dot(p, p) > 1.0 || glm::dot(p, p) < 1e-6);
+		r.p = glm::normalize(p) * 4.0;
+		glm::dvec3 target(u(rng) * spread, u(rng) * spread, u(rng) * spread);
+		r.d = glm::normalize(target - r.p);
+		for (int a = 0; a < 3; a++) {
+			r.pd[a] = r.p[a];
+			r.invd[a] = 1.0 / r.d[a];
+			r.pf[a] = (float)r.p[a];
+			r.invf[a] = (float)(1.0 / r.d[a]);
+		}
+	}
+	return rays;
+}
+
+// Runs kernel(k) over the batch repeat times and keeps the fastest pass.
+template <typename Kernel>
+Result measure(const string& target, const string& variant,
+               const vector<BenchRay>& rays, int repeat, Kernel kernel,
+               vector<Hit>& answers)
+{
+	answers.assign(rays.size(), Hit{false, 0.0});
+	double best = 1e300;
+	size_t hits = 0;
+	for (int r = 0; r < repeat; r++) {
+		hits = 0;
+		auto start = chrono::steady_clock::now();
+		for (size_t k = 0; k < rays.size(); k++) {
+			answers[k] = kernel(k);
+			hits += answers[k].hit;
+		}
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		best = min(best, seconds);
+	}
+	return {target, variant, best * 1e9 / rays.size(),
+	        (double)hits / rays.size(), 1.0, 0.0};
+}
+
+// Fraction of rays where a variant agrees with the reference: same
+// hit/miss answer and, for hits, the same t to within 1e-4 relative.
+double agreement(const vector<Hit>& ref, const vector<Hit>& var)
+{
+	size_t same = 0;
+	for (size_t k = 0; k < ref.size(); k++) {
+		if (ref[k].hit != var[k].hit)
+			continue;
+		if (!ref[k].hit || fabs(ref[k].t - var[k].t) <= 1e-4 * max(1.0, fabs(ref[k].t)))
+			same++;
+	}
+	return (double)same / ref.size();
+}
+
+// Reference kernels go through the tracer's classes.  intersectLocal()
+// takes a mutable ray, so each call gets a fresh copy of the batch ray;
+// the copy is part of what the tracer pays per test as well.
+template <typename Object>
+Hit objectHit(const Object& obj, const BenchRay& br)
+{
+	ray r(br.p, br.d, glm::dvec3(1, 1, 1));
+	isect i;
+	bool hit = obj.intersectLocal(r, i);
+	return {hit, i.getT()};
+}
+
+// Alternative slab tests with a precomputed inverse direction.  Unlike
+// BoundingBox::intersect(), rays parallel to a slab rely on IEEE
+// infinities instead of skipping the axis.
+template <typename T>
+Hit slab(const T* p, const T* inv, const T* lo, const T* hi)
+{
+	T t0 = (T)-1e30, t1 = (T)1e30;
+	for (int a = 0; a < 3; a++) {
+		T n = (lo[a] - p[a]) * inv[a];
+		T f = (hi[a] - p[a]) * inv[a];
+		if (n > f)
+			swap(n, f);
+		t0 = max(t0, n);
+		t1 = min(t1, f);
+	}
+	bool hit = t0 <= t1 && t1 >= (T)RAY_EPSILON;
+	return {hit, (double)t0};
+}
+
+// Analytic unit sphere at the origin, same conventions as Sphere
+template <typename T>
+Hit sphere(const T* p, const T* d)
+{
+	T b = -(p[0] * d[0] + p[1] * d[1] + p[2] * d[2]);
+	T disc = b * b - (p[0] * p[0] + p[1] * p[1] + p[2] * p[2]) + 1;
+	if (disc < 0)
+		return {false, 0.0};
+	disc = sqrt(disc);
+	T t2 = b + disc;
+	if (t2 <= (T)RAY_EPSILON)
+		return {false, 0.0};
+	T t1 = b - disc;
+	return {true, (double)(t1 > (T)RAY_EPSILON ? t1 : t2)};
+}
+
+// Moller-Trumbore, culling back faces like TrimeshFace (the face normal
+// follows the a, b, c winding).
+template <typename T>
+Hit triangle(const T* p, const T* d, const T* a, const T* b, const T* c)
+{
+	T e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+	T e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+	T q[3] = { d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2],
+	           d[0] * e2[1] - d[1] * e2[0] };
+	T det = e1[0] * q[0] + e1[1] * q[1] + e1[2] * q[2];
+	if (det <= (T)1e-12)
+		return {false, 0.0};
+	T s[3] = { p[0] - a[0], p[1] - a[1], p[2] - a[2] };
+	T u = (s[0] * q[0] + s[1] * q[1] + s[2] * q[2]) / det;
+	if (u < 0 || u > 1)
+		return {false, 0.0};
+	T r[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2],
+	           s[0] * e1[1] - s[1] * e1[0] };
+	T v = (d[0] * r[0] + d[1] * r[1] + d[2] * r[2]) / det;
+	if (v < 0 || u + v > 1)
+		return {false, 0.0};
+	T t = (e2[0] * r[0] + e2[1] * r[1] + e2[2] * r[2]) / det;
+	return {t >= 0, (double)t};
+}
+
+void usage(const char* prog)
+{
+	cerr << "usage: " << prog << " [options]" << endl
+	     << "  --rays <#>      rays per batch (default 1000000)" << endl
+	     << "  --repeat <#>    passes per kernel, fastest kept (default 3)" << endl
+	     << "  --seed <#>      seed for the ray batches (default 1)" << endl
+	     << "  --only <TEXT>   only targets whose name contains TEXT" << endl
+	     << "  --json <FILE>   also write the results as JSON" << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+	size_t numRays = 1000000;
+	int repeat = 3;
+	unsigned int seed = 1;
+	string only, jsonFile;
+	for (int a = 1; a < argc; a++) {
+		string arg = argv[a];
+		bool hasValue = a + 1 < argc;
+		if (arg == "--rays" && hasValue)
+			numRays = strtoul(argv[++a], nullptr, 10);
+		else if (arg == "--repeat" && hasValue)
+			repeat = atoi(argv[++a]);
+		else if (arg == "--seed" && hasValue)
+			seed = strtoul(argv[++a], nullptr, 10);
+		else if (arg == "--only" && hasValue)
+			only = argv[++a];
+		else if (arg == "--json" && hasValue)
+			jsonFile = argv[++a];
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (numRays == 0 || repeat <= 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	BenchUI ui;
+	traceUI = &ui;
+
+	vector<Result> results;
+	vector<Hit> ref, var;
+	auto wanted = [&only](const string& target) {
+		return only.empty() || target.find(only) != string::npos;
+	};
+	auto add = [&](Result r, bool reference) {
+		r.agreement = reference ? 1.0 : agreement(ref, var);
+		results.push_back(r);
+		printf("%-14s %-16s %8.2f ns/ray  hit %5.1f%%  agree %6.2f%%\n",
+		       r.target.c_str(), r.variant.c_str(), r.nsPerRay,
+		       r.hitRate * 100.0, r.agreement * 100.0);
+		fflush(stdout);
+	};
+	// BVH targets also report how many nodes a ray visits on average
+	auto nodesPerRay = [&](size_t traced) {
+		results.back().nodesPerRay = (double)TraceUI::resetNodeVisits() / traced;
+		printf("%-31s %8.1f nodes/ray\n", "", results.back().nodesPerRay);
+	};
+
+	vector<BenchRay> rays = makeRays(numRays, seed, 1.5);
+
+	if (wanted("bbox")) {
+		BoundingBox box(glm::dvec3(-1, -1, -1), glm::dvec3(1, 1, 1));
+		const double lo[3] = { -1, -1, -1 }, hi[3] = { 1, 1, 1 };
+		const float lof[3] = { -1, -1, -1 }, hif[3] = { 1, 1, 1 };
+		add(measure("bbox", "reference", rays, repeat, [&](size_t k) {
+			ray r(rays[k].p, rays[k].d, glm::dvec3(1, 1, 1));
+			double t0, t1;
+			bool hit = box.intersect(r, t0, t1);
+			return Hit{hit, t0};
+		}, ref), true);
+		add(measure("bbox", "slab/double", rays, repeat, [&](size_t k) {
+			return slab(rays[k].pd, rays[k].invd, lo, hi);
+		}, var), false);
+		add(measure("bbox", "slab/float", rays, repeat, [&](size_t k) {
+			return slab(rays[k].pf, rays[k].invf, lof, hif);
+		}, var), false);
+	}
+
+	if (wanted("sphere")) {
+		Sphere obj(nullptr, new Material);
+		add(measure("sphere", "reference", rays, repeat, [&](size_t k) {
+			return objectHit(obj, rays[k]);
+		}, ref), true);
+		add(measure("sphere", "analytic/double", rays, repeat, [&](size_t k) {
+			const double d[3] = { rays[k].d[0], rays[k].d[1], rays[k].d[2] };
+			return sphere(rays[k].pd, d);
+		}, var), false);
+		add(measure("sphere", "analytic/float", rays, repeat, [&](size_t k) {
+			const float d[3] = { (float)rays[k].d[0], (float)rays[k].d[1],
+			                     (float)rays[k].d[2] };
+			return sphere(rays[k].pf, d);
+		}, var), false);
+	}
+
+	if (wanted("box")) {
+		Box obj(nullptr, new Material);
+		add(measure("box", "reference", rays, repeat, [&](size_t k) {
+			return objectHit(obj, rays[k]);
+		}, ref), true);
+	}
+	if (wanted("cylinder")) {
+		Cylinder obj(nullptr, new Material);
+		add(measure("cylinder", "reference", rays, repeat, [&](size_t k) {
+			return objectHit(obj, rays[k]);
+		}, ref), true);
+	}
+	if (wanted("cone")) {
+		Cone obj(nullptr, new Material);
+		add(measure("cone", "reference", rays, repeat, [&](size_t k) {
+			return objectHit(obj, rays[k]);
+		}, ref), true);
+	}
+	if (wanted("torus")) {
+		Torus obj(nullptr, new Material, 0.25, 0.75);
+		add(measure("torus", "reference", rays, repeat, [&](size_t k) {
+			return objectHit(obj, rays[k]);
+		}, ref), true);
+	}
+	if (wanted("square")) {
+		Square obj(nullptr, new Material);
+		add(measure("square", "reference", rays, repeat, [&](size_t k) {
+			return objectHit(obj, rays[k]);
+		}, ref), true);
+	}
+
+	// Small random triangles in the unit cube; ray k is tested against
+	// triangle k modulo their count, so caches see a realistic spread.
+	mt19937_64 rng(seed + 1);
+	uniform_real_distribution<double> u(-1.0, 1.0);
+	TransformRoot identity;
+	if (wanted("triangle")) {
+		const int count = 4096;
+		Trimesh soup(nullptr, new Material, &identity);
+		vector<double> verts;
+		for (int f = 0; f < count; f++) {
+			glm::dvec3 center(u(rng), u(rng), u(rng));
+			for (int v = 0; v < 3; v++) {
+				glm::dvec3 p = center + 0.5 * glm::dvec3(u(rng), u(rng), u(rng));
+				soup.addVertex(p);
+				verts.insert(verts.end(), { p[0], p[1], p[2] });
+			}
+		}
+		vector<float> vertsf(verts.begin(), verts.end());
+		vector<unique_ptr<TrimeshFace>> faces;
+		for (int f = 0; f < count; f++)
+			faces.emplace_back(new TrimeshFace(nullptr, new Material, &soup,
+			                                   3 * f, 3 * f + 1, 3 * f + 2));
+		// Aim every ray at its triangle so that hits are common
+		vector<BenchRay> aimed = rays;
+		for (size_t k = 0; k < aimed.size(); k++) {
+			const double* a = &verts[9 * (k % count)];
+			glm::dvec3 centroid((a[0] + a[3] + a[6]) / 3, (a[1] + a[4] + a[7]) / 3,
+			                    (a[2] + a[5] + a[8]) / 3);
+			BenchRay& r = aimed[k];
+			r.d = glm::normalize(centroid + 0.3 * (r.d - glm::normalize(-r.p)) - r.p);
+			for (int i = 0; i < 3; i++) {
+				r.invd[i] = 1.0 / r.d[i];
+				r.invf[i] = (float)r.invd[i];
+			}
+		}
+		add(measure("triangle", "reference", aimed, repeat, [&](size_t k) {
+			return objectHit(*faces[k % count], aimed[k]);
+		}, ref), true);
+		add(measure("triangle", "moller/double", aimed, repeat, [&](size_t k) {
+			const double* a = &verts[9 * (k % count)];
+			const double d[3] = { aimed[k].d[0], aimed[k].d[1], aimed[k].d[2] };
+			return triangle(aimed[k].pd, d, a, a + 3, a + 6);
+		}, var), false);
+		add(measure("triangle", "moller/float", aimed, repeat, [&](size_t k) {
+			const float* a = &vertsf[9 * (k % count)];
+			const float d[3] = { (float)aimed[k].d[0], (float)aimed[k].d[1],
+			                     (float)aimed[k].d[2] };
+			return triangle(aimed[k].pf, d, a, a + 3, a + 6);
+		}, var), false);
+	}
+
+	// Whole-tree queries: a triangle soup through the mesh BVH, and many
+	// small spheres through the scene BVH (object transforms included).
+	if (wanted("bvh-mesh")) {
+		Trimesh mesh(nullptr, new Material, &identity);
+		for (int f = 0; f < 2000; f++) {
+			glm::dvec3 center(u(rng), u(rng), u(rng));
+			for (int v = 0; v < 3; v++)
+				mesh.addVertex(center + 0.05 * glm::dvec3(u(rng), u(rng), u(rng)));
+			mesh.addFace(3 * f, 3 * f + 1, 3 * f + 2);
+		}
+		mesh.ComputeLocalBoundingBox();
+		TraceUI::resetNodeVisits();
+		add(measure("bvh-mesh", "reference", rays, repeat, [&](size_t k) {
+			return objectHit(mesh, rays[k]);
+		}, ref), true);
+		nodesPerRay(repeat * rays.size());
+	}
+	if (wanted("bvh-scene")) {
+		Scene scene;
+		for (int s = 0; s < 4096; s++) {
+			glm::dvec3 center(u(rng), u(rng), u(rng));
+			glm::dmat4x4 xform = glm::translate(center) *
+			                     glm::scale(glm::dvec3(0.03));
+			Sphere* obj = new Sphere(&scene, new Material);
+			obj->setTransform(scene.transformRoot.createChild(xform));
+			scene.add(obj);
+		}
+		scene.Init();
+		TraceUI::resetNodeVisits();
+		add(measure("bvh-scene", "reference", rays, repeat, [&](size_t k) {
+			ray r(rays[k].p, rays[k].d, glm::dvec3(1, 1, 1));
+			isect i;
+			bool hit = scene.intersect(r, i);
+			return Hit{hit, i.getT()};
+		}, ref), true);
+		nodesPerRay(repeat * rays.size());
+	}
+
+	if (!jsonFile.empty()) {
+		Json out = {{"rays", numRays}, {"seed", seed}, {"repeat", repeat}};
+		out["results"] = Json::array();
+		for (const auto& r : results) {
+			Json entry = {{"target", r.target},
+			              {"variant", r.variant},
+			              {"ns_per_ray", r.nsPerRay},
+			              {"hit_rate", r.hitRate},
+			              {"agreement", r.agreement}};
+			if (r.nodesPerRay > 0.0)
+				entry["nodes_per_ray"] = r.nodesPerRay;
+			out["results"].push_back(entry);
+		}
+		ofstream ofs(jsonFile);
+		ofs << out.dump(1, '\t') << endl;
+		if (!ofs) {
+			cerr << "Unable to write '" << jsonFile << "'" << endl;
+			return 2;
+		}
+	}
+	traceUI = nullptr;
+	return 0;
+}
@@ -11,8 +11,11 @@
 #include "parser/Parser.h"
 
 #include "ui/TraceUI.h"
+#include "profile.h"
+#include "denoise.h"
 #include <cmath>
 #include <algorithm>
+#include <limits>
 #include <random>
 #include <glm/glm.hpp>
 #include <glm/gtx/io.hpp>
@@ -33,24 +36,132 @@ extern TraceUI* traceUI;
 // in TraceGLWindow, for example.
 bool debugMode = false;
 
+// What a pixel's rays hit, kept so that the pixel can be shaded again under
+// different lights without tracing anything but shadow rays.  Refraction
+// is the only secondary ray, so each sample is a chain of hits: hit k is
+// lit, and if its material is transmissive the rest of the chain is added
+// on, scaled by factor (the absorption on the way out of an object).
+struct RayTracer::PixelHits {
+	struct Hit {
+		glm::dvec3 origin, direction; // of the ray that got here
+		const SceneObject* obj;
+		double t;
+		glm::dvec3 N;
+		glm::dvec2 uv;
+		double uvFootprint;
+		int material; // into materials, or -1 for the object's own
+		glm::dvec3 factor;
+	};
+	struct Sample {
+		int index; // in the supersampling grid
+		size_t end; // one past its last hit
+		// Color where the chain ends in a transmissive hit: the cubemap
+		// if the last ray escaped, black if it ran out of depth.
+		glm::dvec3 tail;
+	};
+	std::vector<Hit> hits;
+	std::vector<Sample> samples;
+	// Per-hit materials, e.g. interpolated from trimesh vertices
+	std::vector<Material> materials;
+
+	void clear()
+	{
+		hits.clear();
+		samples.clear();
+		materials.clear();
+	}
+	void start(int index)
+	{
+		samples.push_back(Sample{ index, hits.size(), glm::dvec3(0, 0, 0) });
+	}
+};
+
+struct RayTracer::HitCache {
+	// What the hits depend on besides the scene
+	int width, height;
+	TraceSettings settings;
+	std::vector<PixelHits> pixels;
+};
+
+thread_local RayTracer::PixelHits* RayTracer::recording = nullptr;
+thread_local RayTracer::PixelFeatures* RayTracer::features = nullptr;
+thread_local float* RayTracer::aovPixel = nullptr;
+// Time this worker spent on the samples beyond each pixel's first, while
+// profiling: what anti-aliasing adds to the tile being traced
+static thread_local Profiler::clock::duration aaTime;
+
+RayTracer::TraceSettings RayTracer::currentSettings() const
+{
+	TraceSettings s;
+	s.depth = traceUI->getDepth();
+	s.aa = traceUI->aaSwitch();
+	s.samples = traceUI->getSuperSamples();
+	s.aaThresh = traceUI->getAaThreshold();
+	s.cubemap = traceUI->cubeMap();
+	s.cubemapVersion = traceUI->cubeMapVersion();
+	s.filterWidth = traceUI->getFilterWidth();
+	return s;
+}
+
+bool RayTracer::TraceSettings::sameBackground(const TraceSettings& o) const
+{
+	return cubemap == o.cubemap &&
+	       (!cubemap || (cubemapVersion == o.cubemapVersion && filterWidth == o.filterWidth));
+}
+
+// Supersampling settings only matter with anti-aliasing on
+bool RayTracer::TraceSettings::sameSampling(const TraceSettings& o) const
+{
+	return aa == o.aa && (!aa || (samples == o.samples && aaThresh == o.aaThresh));
+}
+
 // Trace a top-level ray through pixel(i,j), i.e. normalized window coordinates (x,y),
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
 // in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
 
-glm::dvec3 RayTracer::trace(double x, double y)
+glm::dvec3 RayTracer::trace(double x, double y, SampleStats* stats)
 {
-	// Clear out the ray cache in the scene for debugging purposes,
-	if (TraceUI::m_debug)
-	{
-		scene->clearIntersectCache();		
-	}
+	// A single debugging ray shows just its own rays
+	if (debugMode)
+		scene->getRayLog().clear();
+
+	// Each primary ray stands for a pixel's worth of the view
+	double pixelSpread = glm::length(scene->getCamera().getV()) / buffer_height;
 
+	glm::dvec3 ret;
+	supersample(x, y, ret, [this, pixelSpread, stats](int index, double sx, double sy, glm::dvec3& color) {
+		ray r(glm::dvec3(0,0,0), glm::dvec3(0,0,0), glm::dvec3(1,1,1), ray::VISIBILITY);
+		scene->getCamera().rayThrough(sx, sy, r);
+		r.setCone(0.0, pixelSpread);
+		double dummy;
+		if (recording)
+			recording->start(index);
+		color = traceRay(r, glm::dvec3(1.0,1.0,1.0), 0, dummy);
+		if (stats) {
+			// Of the samples as supersample() averages them
+			glm::dvec3 c = glm::clamp(color, 0.0, 1.0);
+			double l = 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+			stats->count++;
+			stats->sum += l;
+			stats->sumSq += l * l;
+		}
+		return true;
+	});
+	return ret;
+}
+
+// Average the samples of the pixel at (x, y).  sample(index, x, y, color)
+// computes one of them; if it returns false the pixel is given up on and
+// false is returned.
+template <typename Sample>
+bool RayTracer::supersample(double x, double y, glm::dvec3& ret, Sample sample)
+{
 	double param = 128.0;
 	default_random_engine generator;
 	poisson_distribution<int> pois(param);
 
-	auto ret = glm::dvec3(0, 0, 0);
+	ret = glm::dvec3(0, 0, 0);
 	int scale = 1;
 	int aa_thresh = 0;
 	int counter = 0;
@@ -59,11 +170,12 @@ glm::dvec3 RayTracer::trace(double x, double y)
 	auto prev = glm::dvec3(0, 0, 0);
 	bool skip = false;
 
-	if(traceUI->aaSwitch())
+	if(traceUI->aaSwitch() && !previewPass)
 	{
 		scale = traceUI->getSuperSamples();
 		aa_thresh = traceUI->getAaThreshold();	
 	}
+	bool timing = Profiler::enabled() && scale > 1;
 	for(int i = 0 ; i < scale; i ++)
 	{
 		skip = false;
@@ -75,12 +187,17 @@ glm::dvec3 RayTracer::trace(double x, double y)
 			if(thresh < param - scale)
 			{
 				int len = aa_thresh/scale;
-				ray r(glm::dvec3(0,0,0), glm::dvec3(0,0,0), glm::dvec3(1,1,1), ray::VISIBILITY);
-				scene->getCamera().rayThrough(x + aa_thresh/2 - i*len,y + aa_thresh/2 - j*len,r);
-				double dummy;
 				if(skip) 
 					continue;
-				glm::dvec3 temp = traceRay(r, glm::dvec3(1.0,1.0,1.0), 0, dummy);
+				glm::dvec3 temp;
+				Profiler::clock::time_point begin;
+				if (timing && counter > 0)
+					begin = Profiler::clock::now();
+				if (!sample(i * scale + j, x + aa_thresh/2 - i*len,
+				            y + aa_thresh/2 - j*len, temp))
+					return false;
+				if (timing && counter > 0)
+					aaTime += Profiler::clock::now() - begin;
 				curr = temp;
 				skip = prev == curr;
 				prev = curr;
@@ -92,7 +209,7 @@ glm::dvec3 RayTracer::trace(double x, double y)
 	}
 	ret *= 1.0/counter; //FIXME? I'm not sure if this is actually averaging out the rays/anti-aliasing them
 	
-	return ret;
+	return true;
 }
 
 glm::dvec3 RayTracer::tracePixel(int i, int j)
@@ -101,18 +218,165 @@ glm::dvec3 RayTracer::tracePixel(int i, int j)
 
 	if( ! sceneLoaded() ) return col;
 
-	double x = double(i)/double(buffer_width);
-	double y = double(j)/double(buffer_height);
+	if (costRecording) {
+		auto start = std::chrono::steady_clock::now();
+		int rays = TraceUI::getCount(ray_thread_id);
+		long long visits = TraceUI::getNodeVisits(ray_thread_id);
+		col = samplePixel(i, j);
+		float *cost = costBuffer.data() + ( i + (size_t)j * buffer_width ) * 3;
+		cost[0] += std::chrono::duration<float, std::micro>(
+		        std::chrono::steady_clock::now() - start).count();
+		cost[1] += TraceUI::getCount(ray_thread_id) - rays;
+		cost[2] += TraceUI::getNodeVisits(ray_thread_id) - visits;
+	} else {
+		col = samplePixel(i, j);
+	}
 
-	unsigned char *pixel = buffer.data() + ( i + j * buffer_width ) * 3;
-	col = trace(x, y);
+	float *fpixel = floatBuffer + ( i + (size_t)j * buffer_width ) * 3;
+	fpixel[0] = (float)col[0];
+	fpixel[1] = (float)col[1];
+	fpixel[2] = (float)col[2];
 
+	unsigned char *pixel = buffer + ( i + (size_t)j * buffer_width ) * 3;
 	pixel[0] = (int)( 255.0 * col[0]);
 	pixel[1] = (int)( 255.0 * col[1]);
 	pixel[2] = (int)( 255.0 * col[2]);
 	return col;
 }
 
+glm::dvec3 RayTracer::samplePixel(int i, int j)
+{
+	double x = double(i)/double(buffer_width);
+	double y = double(j)/double(buffer_height);
+
+	glm::dvec3 col;
+	if (hits) {
+		PixelHits& pixel = hits->pixels[i + (size_t)j * buffer_width];
+		if (relightPass && relightPixel(pixel, x, y, col))
+			return col;
+		pixel.clear();
+		recording = &pixel;
+	}
+	if (!pixelFeatures.empty()) {
+		features = pixelFeatures.data() + i + (size_t)j * buffer_width;
+		*features = PixelFeatures();
+	}
+	SampleStats stats;
+	if (!aovBuffer.empty())
+		aovPixel = aovBuffer.data() + (i + (size_t)j * buffer_width) * 3;
+	// A pixel picked by hand in the debugger is logged whatever the filters
+	if (TraceUI::m_debug)
+		RayLog::setPixel(debugMode ? -1 : i, debugMode ? -1 : j);
+	col = trace(x, y, aovBuffer.empty() ? nullptr : &stats);
+	recording = nullptr;
+	features = nullptr;
+	aovPixel = nullptr;
+	if (!aovBuffer.empty()) {
+		float* variance = aovBuffer.data() + AOV_VARIANCE * bufferSize +
+		                  (i + (size_t)j * buffer_width) * 3;
+		double mean = stats.sum / std::max(stats.count, 1);
+		variance[0] = stats.count > 1
+		        ? (float)(std::max(stats.sumSq - stats.sum * mean, 0.0) /
+		                  ((stats.count - 1) * stats.count))
+		        : 0.0f;
+		variance[1] = (float)stats.count;
+		variance[2] = 0.0f;
+	}
+	return col;
+}
+
+const char* RayTracer::aovName(AOV which)
+{
+	static const char* names[AOV_COUNT] = { "depth", "normal", "albedo", "id", "uv", "variance" };
+	return names[which];
+}
+
+void RayTracer::getAOVBuffer(AOV which, const float*& buf, int& w, int& h)
+{
+	buf = aovBuffer.empty() ? nullptr : aovBuffer.data() + which * bufferSize;
+	w = buffer_width;
+	h = buffer_height;
+}
+
+bool RayTracer::denoiseImage()
+{
+	waitRender();
+	if (aovBuffer.empty() || bufferSize == 0)
+		return false;
+	const float* plane[AOV_COUNT];
+	for (int a = 0; a < AOV_COUNT; a++)
+		plane[a] = aovBuffer.data() + a * bufferSize;
+	DenoiseSettings settings;
+	settings.threads = threads;
+	denoise(buffer_width, buffer_height, floatBuffer, plane[AOV_NORMAL],
+	        plane[AOV_ALBEDO], plane[AOV_DEPTH], plane[AOV_ID],
+	        plane[AOV_VARIANCE], settings);
+	// Same quantization as tracePixel()
+	for (size_t k = 0; k < bufferSize; k++)
+		buffer[k] = (int)(255.0 * floatBuffer[k]);
+	return true;
+}
+
+void RayTracer::storeAOVs(const isect& i, bool hit)
+{
+	float values[AOV_COUNT][3] = {};
+	if (hit) {
+		glm::dvec3 N = i.getN();
+		glm::dvec3 kd = i.getMaterial().kd(i);
+		glm::dvec2 uv = i.getUVCoordinates();
+		for (int c = 0; c < 3; c++) {
+			values[AOV_DEPTH][c] = (float)i.getT();
+			values[AOV_NORMAL][c] = (float)N[c];
+			values[AOV_ALBEDO][c] = (float)kd[c];
+			values[AOV_ID][c] = (float)(i.getObjectId() + 1);
+		}
+		values[AOV_UV][0] = (float)uv[0];
+		values[AOV_UV][1] = (float)uv[1];
+	}
+	for (int a = 0; a < AOV_VARIANCE; a++)
+		std::copy(values[a], values[a] + 3, aovPixel + a * bufferSize);
+	aovPixel = nullptr;
+}
+
+// Shade the pixel again from its recorded hits.  This gives exactly what
+// tracing it would, as long as the same samples are taken; if the new
+// colors call for a sample that was skipped last time, returns false.
+bool RayTracer::relightPixel(const PixelHits& pixel, double x, double y, glm::dvec3& col)
+{
+	size_t next = 0;
+	return supersample(x, y, col, [&](int index, double, double, glm::dvec3& color) {
+		while (next < pixel.samples.size() && pixel.samples[next].index < index)
+			next++;
+		if (next == pixel.samples.size() || pixel.samples[next].index != index)
+			return false;
+		const PixelHits::Sample& sample = pixel.samples[next];
+		size_t begin = next > 0 ? pixel.samples[next - 1].end : 0;
+		next++;
+
+		// Same arithmetic as traceRay(), from the end of the chain back
+		color = sample.tail;
+		for (size_t k = sample.end; k-- > begin;) {
+			const PixelHits::Hit& hit = pixel.hits[k];
+			ray r(hit.origin, hit.direction, glm::dvec3(1, 1, 1), ray::VISIBILITY);
+			isect i;
+			i.setObject(hit.obj);
+			i.setT(hit.t);
+			i.setN(hit.N);
+			i.setUVCoordinates(hit.uv);
+			i.setUVFootprint(hit.uvFootprint);
+			if (hit.material >= 0)
+				i.setMaterial(pixel.materials[hit.material]);
+			const Material& m = i.getMaterial();
+			glm::dvec3 c(0, 0, 0);
+			c += m.shade(scene.get(), r, i);
+			if (m.Trans())
+				c += color * hit.factor;
+			color = c;
+		}
+		return true;
+	});
+}
+
 #define VERBOSE 0
 
 glm::dvec3 refl_helper(ray& r, const glm::dvec3& n)
@@ -127,14 +391,22 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 	isect i;
 	glm::dvec3 colorC = glm::dvec3(0, 0, 0);
 
-	if(depth > traceUI->getDepth()) 
+	if(depth > traceUI->getDepth()) {
+		if (features)
+			features->flags |= PixelFeatures::TRUNCATED;
 		return colorC;
+	}
+	if (features)
+		features->depth = std::max<int>(features->depth, depth);
 
 #if VERBOSE
 	std::cerr << "== current depth: " << depth << std::endl;
 #endif
 
-	if(scene->intersect(r, i)) {
+	bool hit = scene->intersect(r, i);
+	if (aovPixel && depth == 0)
+		storeAOVs(i, hit);
+	if(hit) {
 		// YOUR CODE HERE
 
 		// An intersection occurred!  We've got work to do.  For now,
@@ -149,6 +421,22 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 		const Material& m = i.getMaterial();
 		colorC += m.shade(scene.get(), r, i);
 
+		size_t hit = 0;
+		if (recording) {
+			hit = recording->hits.size();
+			int material = -1;
+			if (&m != &i.getObject()->getMaterial()) {
+				material = recording->materials.size();
+				recording->materials.push_back(m);
+			}
+			recording->hits.push_back(PixelHits::Hit{
+			        r.getPosition(), r.getDirection(), i.getObject(),
+			        i.getT(), i.getN(), i.getUVCoordinates(),
+			        i.getUVFootprint(), material,
+			        glm::dvec3(1, 1, 1) });
+			recording->samples.back().end = recording->hits.size();
+		}
+
 		if(m.Trans())
 		{
 			bool inside = glm::dot(r.getDirection(), i.getN()) >= RAY_EPSILON;
@@ -179,6 +467,7 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 			}
 			double dummy;
 			auto nextRay(ray(r.at(i.getT()), glm::normalize(dir), glm::dvec3(1, 1, 1), ray::RayType::REFRACTION));
+			nextRay.setCone(r.footprint(i.getT()), r.getSpread());
 			auto temp = traceRay(nextRay, thresh, depth + 1, dummy);
 			if(debugMode) {
 				cout << "KT ATTENTUATION" << endl;
@@ -187,6 +476,8 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 			if(inside) {
 				for(int j = 0; j < 3; j++){
 					temp[j] *= pow(m.kt(i)[j], i.getT());
+					if (recording)
+						recording->hits[hit].factor[j] = pow(m.kt(i)[j], i.getT());
 				}
 			}
 			if(debugMode) {
@@ -232,6 +523,10 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 				cout << "CubeMap NOT enabled! " << endl;
 			colorC = glm::dvec3(0.0, 0.0, 0.0);
 		}
+		if (recording)
+			recording->samples.back().tail = colorC;
+		if (features)
+			features->flags |= PixelFeatures::ESCAPED;
 	}
 #if VERBOSE
 	std::cerr << "== depth: " << depth+1 << " done, returning: " << colorC << std::endl;
@@ -239,35 +534,103 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 	return colorC;
 }
 
+// Edge length of the square tiles handed out to worker threads
+static const int TILE_SIZE = 32;
+
+// Checkpoint files hold, in host byte order: this magic, the length and
+// bytes of the render's signature, the geometry below, one byte per tile
+// saying whether it is finished, then the 8-bit and float buffers.
+static const char CHECKPOINT_MAGIC[8] = { 'R', 'A', 'Y', 'C', 'K', 'P', 'T', '1' };
+
+struct RayTracer::Checkpoint {
+	// width, height, traced area (x0, y0, x1, y1), tile size
+	int geometry[7];
+	std::vector<unsigned char> tiles;
+	std::vector<unsigned char> pixels;
+	std::vector<float> colors;
+};
+
 RayTracer::RayTracer()
-	: scene(nullptr), buffer(0), thresh(0), buffer_width(0), buffer_height(0), m_bBufferReady(false)
+	: scene(nullptr), buffer(nullptr), floatBuffer(nullptr), bufferSize(0), thresh(0), buffer_width(0), buffer_height(0),
+	  stopTrace(false), nextTile(0), workersDone(0), tilesX(0), tilesY(0),
+	  parseSeconds(0.0), buildSeconds(0.0), previewPass(false), relightPass(false), updatePass(false), costRecording(false), aovRecording(false), keepingHits(false), hasRegion(false), m_bBufferReady(false)
 {
 }
 
 RayTracer::~RayTracer()
 {
+	stopTrace = true;
+	waitRender();
 }
 
 void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
 {
-	buf = buffer.data();
+	buf = buffer;
+	w = buffer_width;
+	h = buffer_height;
+}
+
+void RayTracer::getFloatBuffer( const float *&buf, int &w, int &h )
+{
+	buf = floatBuffer;
+	w = buffer_width;
+	h = buffer_height;
+}
+
+void RayTracer::getCostBuffer( const float *&buf, int &w, int &h )
+{
+	buf = costBuffer.empty() ? nullptr : costBuffer.data();
 	w = buffer_width;
 	h = buffer_height;
 }
 
+void RayTracer::setScene(const std::shared_ptr<Scene>& s)
+{
+	scene = s;
+	hits.reset();
+	pixelFeatures.clear();
+}
+
+void RayTracer::clearRegion()
+{
+	hasRegion = false;
+	pixelFeatures.clear();
+}
+
+void RayTracer::setRegion(int x0, int y0, int x1, int y1)
+{
+	pixelFeatures.clear();
+	regionX0 = x0;
+	regionY0 = y0;
+	regionX1 = x1;
+	regionY1 = y1;
+	hasRegion = true;
+}
+
 double RayTracer::aspectRatio()
 {
 	return sceneLoaded() ? scene->getCamera().getAspectRatio() : 1;
 }
 
 bool RayTracer::loadScene(const char* fn)
+{
+	Scene* loaded = readScene(fn);
+	if (!loaded)
+		return false;
+	scene.reset(loaded);
+	hits.reset();
+	pixelFeatures.clear();
+	return sceneLoaded();
+}
+
+Scene* RayTracer::readScene(const char* fn)
 {
 	ifstream ifs(fn);
 	if( !ifs ) {
 		string msg( "Error: couldn't read scene file " );
 		msg.append( fn );
 		traceUI->alert( msg );
-		return false;
+		return nullptr;
 	}
 
 	// Strip off filename, leaving only the path:
@@ -280,44 +643,102 @@ bool RayTracer::loadScene(const char* fn)
 	// Call this with 'true' for debug output from the tokenizer
 	Tokenizer tokenizer( ifs, false );
 	Parser parser( tokenizer, path );
+	Scene* loaded = nullptr;
+	auto start = std::chrono::steady_clock::now();
 	try {
-		scene.reset(parser.parseScene());
+		loaded = parser.parseScene();
 	}
 	catch( SyntaxErrorException& pe ) {
 		traceUI->alert( pe.formattedMessage() );
-		return false;
+		return nullptr;
 	} catch( ParserException& pe ) {
 		string msg( "Parser: fatal exception " );
 		msg.append( pe.message() );
 		traceUI->alert( msg );
-		return false;
+		return nullptr;
 	} catch( TextureMapException e ) {
 		string msg( "Texture mapping exception: " );
 		msg.append( e.message() );
 		traceUI->alert( msg );
-		return false;
+		return nullptr;
 	}
 
-	scene->Init();
+	auto parsed = std::chrono::steady_clock::now();
+	if (loaded)
+		loaded->Init();
+	auto built = std::chrono::steady_clock::now();
+	parseSeconds = std::chrono::duration<double>(parsed - start).count();
+	buildSeconds = std::chrono::duration<double>(built - parsed).count();
+	if (Profiler::enabled()) {
+		Profiler::span("parse", "phase", start, parsed, -1, fn);
+		Profiler::span("BVH build", "phase", parsed, built);
+	}
+	return loaded;
+}
 
+bool RayTracer::applyFrame(const FrameUpdate& frame)
+{
 	if (!sceneLoaded())
 		return false;
-
+	pixelFeatures.clear();
+	bool moved = false;
+	string error = scene->applyFrame(frame, &moved);
+	if (!error.empty()) {
+		traceUI->alert("Animation: " + error);
+		return false;
+	}
+	// Lights only change how the recorded hits are shaded; a camera or
+	// object that moved changes the hits themselves
+	if (moved)
+		hits.reset();
 	return true;
 }
 
 void RayTracer::traceSetup(int w, int h)
 {
-	size_t newBufferSize = w * h * 3;
-	if (newBufferSize != buffer.size()) {
-		bufferSize = newBufferSize;
-		buffer.resize(bufferSize);
+	// The float pixels, then the 8-bit ones
+	bufferSize = (size_t)w * h * 3;
+	size_t floats = bufferSize + (bufferSize + sizeof(float) - 1) / sizeof(float);
+	if (!pixelDir.empty() && bufferSize > 0 &&
+	    pixelFile.data() && pixelFile.size() == floats * sizeof(float)) {
+		// Same size as last time (traceImage() sets up again after the
+		// UI has, and so does every frame of an animation)
+		pixelFile.clear();
+		floatBuffer = (float*)pixelFile.data();
+	} else if (!pixelDir.empty() && bufferSize > 0 &&
+	           pixelFile.create(pixelDir, floats * sizeof(float))) {
+		// A fresh file comes zeroed without touching a page
+		pixelMemory = std::vector<float>();
+		floatBuffer = (float*)pixelFile.data();
+	} else {
+		if (!pixelDir.empty() && bufferSize > 0) {
+			traceUI->alert("Unable to create a framebuffer file in '" + pixelDir +
+			               "'; keeping the image in memory");
+			pixelDir.clear();
+		}
+		pixelFile.close();
+		pixelMemory.assign(floats, 0.0f);
+		floatBuffer = pixelMemory.data();
 	}
+	buffer = (unsigned char*)(floatBuffer + bufferSize);
 	buffer_width = w;
 	buffer_height = h;
-	std::fill(buffer.begin(), buffer.end(), 0);
+	if (costRecording)
+		costBuffer.assign(bufferSize, 0.0f);
+	else
+		costBuffer.clear();
+	// Kept as they are, for a relight or update that only traces some
+	// pixels again; traceImage() clears them
+	if (aovRecording)
+		aovBuffer.resize(AOV_COUNT * bufferSize);
+	else
+		aovBuffer.clear();
 	m_bBufferReady = true;
+	syncSettings();
+}
 
+void RayTracer::syncSettings()
+{
 	/*
 	 * Sync with TraceUI
 	 */
@@ -327,6 +748,8 @@ void RayTracer::traceSetup(int w, int h)
 	thresh = traceUI->getThreshold();
 	samples = traceUI->getSuperSamples();
 	aaThresh = traceUI->getAaThreshold();
+	if (scene)
+		scene->getTextureCache().setBudget(traceUI->getTextureBudget());
 
 	// YOUR CODE HERE
 	// FIXME: Additional initializations
@@ -342,72 +765,463 @@ void RayTracer::traceSetup(int w, int h)
  *		h:	height of the image buffer
  *
  */
-void RayTracer::traceImage(int w, int h)
+void RayTracer::traceImage(int w, int h, bool preview)
 {
+	// A previous render may still be winding down after being stopped.
+	waitRender();
+
 	// Always call traceSetup before rendering anything.
 	traceSetup(w,h);
 
-	// YOUR CODE HERE
-	// FIXME: Start one or more threads for ray tracing
-	//
-	// TIPS: Ideally, the traceImage should be executed asynchronously,
-	//       i.e. returns IMMEDIATELY after working threads are launched.
-	//
-	//       An asynchronous traceImage lets the GUI update your results
-	//       while rendering.
+	traceX0 = 0;
+	traceY0 = 0;
+	traceX1 = w;
+	traceY1 = h;
+	if (hasRegion) {
+		traceX0 = std::max(traceX0, regionX0);
+		traceY0 = std::max(traceY0, regionY0);
+		traceX1 = std::max(traceX0, std::min(traceX1, regionX1));
+		traceY1 = std::max(traceY0, std::min(traceY1, regionY1));
+	}
+	tilesX = (traceX1 - traceX0 + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (traceY1 - traceY0 + TILE_SIZE - 1) / TILE_SIZE;
+	tileDone = std::vector<std::atomic<bool>>(tilesX * tilesY);
+	for (auto& done : tileDone)
+		done = false;
+	std::fill(aovBuffer.begin(), aovBuffer.end(), 0.0f);
+	if (TraceUI::m_debug && sceneLoaded())
+		scene->getRayLog().clear();
 
-	// Single threaded rn
-	for(int x = 0; x < w; x++){
-		for(int y = 0; y < h; y++) {
-			tracePixel(x, y);
+	if (resume) {
+		int geometry[7] = { w, h, traceX0, traceY0, traceX1, traceY1, TILE_SIZE };
+		if (memcmp(geometry, resume->geometry, sizeof(geometry)) == 0) {
+			std::copy(resume->pixels.begin(), resume->pixels.end(), buffer);
+			std::copy(resume->colors.begin(), resume->colors.end(), floatBuffer);
+			for (size_t t = 0; t < tileDone.size(); t++)
+				tileDone[t] = resume->tiles[t] != 0;
+		} else {
+			traceUI->alert("Checkpoint is for a different image size or region; starting over");
 		}
+		resume.reset();
 	}
+	previewPass = preview && traceUI->aaSwitch();
+	relightPass = false;
+
+	// A preview is only a stand-in, not worth recording
+	if (keepingHits && !previewPass) {
+		if (!hits || hits->width != w || hits->height != h) {
+			hits.reset(new HitCache);
+			hits->pixels.resize((size_t)w * h);
+		} else {
+			for (auto& pixel : hits->pixels)
+				pixel.clear();
+		}
+		hits->width = w;
+		hits->height = h;
+		hits->settings = currentSettings();
+	} else {
+		hits.reset();
+	}
+	// Too much to keep for an image that doesn't fit in memory
+	if (pixelFile.data())
+		pixelFeatures.clear();
+	else
+		pixelFeatures.assign((size_t)w * h, PixelFeatures());
+	traced = currentSettings();
+	updatePass = false;
+
+	scheduleTiles();
+	startWorkers();
+}
+
+void RayTracer::keepHits(bool on)
+{
+	keepingHits = on;
+	if (!on)
+		hits.reset();
+}
+
+bool RayTracer::relightImage()
+{
+	waitRender();
+	TraceSettings now = currentSettings();
+	if (!hits || !sceneLoaded() || hits->width != buffer_width ||
+	    hits->height != buffer_height || hits->settings.depth != now.depth ||
+	    !hits->settings.sameSampling(now) || !hits->settings.sameBackground(now))
+		return false;
+
+	// Every pixel of the traced area is written again
+	for (auto& done : tileDone)
+		done = false;
+	if (costRecording)
+		std::fill(costBuffer.begin(), costBuffer.end(), 0.0f);
+	previewPass = false;
+	relightPass = true;
+	updatePass = false;
+	scheduleTiles();
+	startWorkers();
+	return true;
+}
+
+bool RayTracer::updateImage(int w, int h)
+{
+	waitRender();
+	if (!sceneLoaded() || pixelFeatures.size() != (size_t)w * h ||
+	    w != buffer_width || h != buffer_height || previewPass ||
+	    tilesFinished() != tileCount())
+		return false;
+
+	// Supersampling touches every pixel, except when it is switched on:
+	// then the image so far serves as the preview for aaImage().
+	TraceSettings now = currentSettings();
+	bool aaOn = !traced.aa && now.aa;
+	if (!aaOn && !traced.sameSampling(now))
+		return false;
+
+	std::vector<char> stale(pixelFeatures.size(), 0);
+	for (int t = 0; t < tilesX * tilesY; t++) {
+		int x0 = traceX0 + (t % tilesX) * TILE_SIZE;
+		int y0 = traceY0 + (t / tilesX) * TILE_SIZE;
+		int x1 = std::min(x0 + TILE_SIZE, traceX1);
+		int y1 = std::min(y0 + TILE_SIZE, traceY1);
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++) {
+				const PixelFeatures& f = pixelFeatures[x + (size_t)y * w];
+				bool changed =
+				        (now.depth < traced.depth && f.depth > now.depth) ||
+				        (now.depth > traced.depth && (f.flags & PixelFeatures::TRUNCATED)) ||
+				        (!now.sameBackground(traced) && (f.flags & PixelFeatures::ESCAPED));
+				if (changed) {
+					stale[x + (size_t)y * w] = 1;
+					tileDone[t] = false;
+				}
+			}
+	}
+	staleBuffer.swap(stale);
+
+	// The hits of pixels that aren't traced again are kept for the old
+	// settings, so they can't be mixed with new ones
+	hits.reset();
+	syncSettings();
+	traced = now;
+	previewPass = aaOn;
+	relightPass = false;
+	updatePass = true;
+	scheduleTiles();
+	startWorkers();
+	return true;
+}
+
+void RayTracer::scheduleTiles()
+{
+	tileOrder.clear();
+	for (int t = 0; t < tilesX * tilesY; t++)
+		if (!tileDone[t])
+			tileOrder.push_back(t);
+	if (tileCost.size() == tileDone.size())
+		std::stable_sort(tileOrder.begin(), tileOrder.end(),
+		                 [this](int a, int b) { return tileCost[a] > tileCost[b]; });
+	tileCost.assign(tileDone.size(), 0.0f);
+}
+
+void RayTracer::startWorkers()
+{
+	nextTile = 0;
+	workersDone = 0;
+	stopTrace = false;
+
+	// Returns right away; the GUI polls checkRender() to show progress.
+	unsigned int n = std::max(1u, std::min(threads, (unsigned int)MAX_THREADS));
+	for (unsigned int id = 0; id < n; id++)
+		workers.emplace_back(&RayTracer::traceTiles, this, id);
+}
+
+void RayTracer::traceTiles(unsigned int id)
+{
+	// Per-thread ray counters in TraceUI are indexed by this.
+	ray_thread_id = id;
+	RayLog::setWorker(id);
+	Profiler::nameThread("worker " + std::to_string(id));
+	ProfileScope busy("worker", "thread");
+	int tiles = tileOrder.size();
+	for (int k = nextTile++; k < tiles && !stopTrace; k = nextTile++) {
+		int t = tileOrder[k];
+		ProfileScope span("tile", "tile", t);
+		auto start = std::chrono::steady_clock::now();
+		aaTime = Profiler::clock::duration::zero();
+		int x0 = traceX0 + (t % tilesX) * TILE_SIZE;
+		int y0 = traceY0 + (t / tilesX) * TILE_SIZE;
+		int x1 = std::min(x0 + TILE_SIZE, traceX1);
+		int y1 = std::min(y0 + TILE_SIZE, traceY1);
+		// Rows are short enough to stop between when a deadline hits
+		int y = y0;
+		for (; y < y1 && !stopTrace; y++)
+			for (int x = x0; x < x1; x++)
+				if (!updatePass || staleBuffer[x + (size_t)y * buffer_width])
+					tracePixel(x, y);
+		if (y == y1) {
+			tileDone[t] = true;
+			if (pixelFile.data())
+				releaseTileRow(t / tilesX);
+		}
+		auto end = std::chrono::steady_clock::now();
+		tileCost[t] += std::chrono::duration<float>(end - start).count();
+		// Supersampling is interleaved with each pixel's first sample, so
+		// its share of the tile is drawn as one span closing the tile
+		if (aaTime > Profiler::clock::duration::zero())
+			Profiler::span("AA", "tile", end - aaTime, end, t);
+	}
+	workersDone++;
+}
+
+int RayTracer::tilesFinished() const
+{
+	int finished = 0;
+	for (const auto& done : tileDone)
+		finished += done ? 1 : 0;
+	return finished;
+}
+
+bool RayTracer::tileRowDone(int row, int& y0, int& y1) const
+{
+	y0 = traceY0 + row * TILE_SIZE;
+	y1 = std::min(y0 + TILE_SIZE, traceY1);
+	for (int t = row * tilesX; t < (row + 1) * tilesX; t++)
+		if (!tileDone[t])
+			return false;
+	return true;
+}
+
+void RayTracer::releaseTileRow(int row)
+{
+	// Whichever worker finishes the last tile across does it; should two
+	// finish at once, releasing twice does no harm.
+	int y0, y1;
+	if (!tileRowDone(row, y0, y1))
+		return;
+	size_t first = (size_t)y0 * buffer_width * 3;
+	size_t count = (size_t)(y1 - y0) * buffer_width * 3;
+	pixelFile.release(first * sizeof(float), count * sizeof(float));
+	pixelFile.release(bufferSize * sizeof(float) + first, count);
+}
+
+bool RayTracer::writeCheckpoint(const string& path, const string& signature)
+{
+	// Read the tile flags before the pixels.  A tile is only flagged once
+	// all of its pixels are written; pixels of unflagged tiles may be
+	// caught half way but are traced again on resume anyway.
+	std::vector<unsigned char> tiles(tileDone.size());
+	for (size_t t = 0; t < tiles.size(); t++)
+		tiles[t] = tileDone[t] ? 1 : 0;
+	int geometry[7] = { buffer_width, buffer_height,
+	                    traceX0, traceY0, traceX1, traceY1, TILE_SIZE };
+	unsigned int length = signature.size();
+
+	// Write next to the target and rename, so that a crash mid-write
+	// leaves the previous checkpoint intact.
+	string tmp = path + ".tmp";
+	FILE* file = fopen(tmp.c_str(), "wb");
+	if (!file)
+		return false;
+	bool ok = fwrite(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC), 1, file) == 1 &&
+	          fwrite(&length, sizeof(length), 1, file) == 1 &&
+	          fwrite(signature.data(), 1, length, file) == length &&
+	          fwrite(geometry, sizeof(geometry), 1, file) == 1 &&
+	          fwrite(tiles.data(), 1, tiles.size(), file) == tiles.size() &&
+	          fwrite(buffer, 1, bufferSize, file) == bufferSize &&
+	          fwrite(floatBuffer, sizeof(float), bufferSize, file) == bufferSize;
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		remove(tmp.c_str());
+		return false;
+	}
+#ifdef _WIN32
+	// rename() won't replace an existing file here
+	remove(path.c_str());
+#endif
+	return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool RayTracer::resumeFrom(const string& path, const string& signature)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+
+	std::unique_ptr<Checkpoint> cp(new Checkpoint);
+	char magic[sizeof(CHECKPOINT_MAGIC)];
+	unsigned int length = 0;
+	string saved;
+	bool ok = fread(magic, sizeof(magic), 1, file) == 1 &&
+	          memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) == 0 &&
+	          fread(&length, sizeof(length), 1, file) == 1 &&
+	          length == signature.size();
+	if (ok) {
+		saved.resize(length);
+		ok = fread(&saved[0], 1, length, file) == length && saved == signature &&
+		     fread(cp->geometry, sizeof(cp->geometry), 1, file) == 1;
+	}
+	if (ok) {
+		const int* g = cp->geometry;
+		ok = g[0] > 0 && g[1] > 0 && g[6] > 0 && g[2] >= 0 && g[3] >= 0 &&
+		     g[2] <= g[4] && g[3] <= g[5] && g[4] <= g[0] && g[5] <= g[1];
+	}
+	if (ok) {
+		const int* g = cp->geometry;
+		size_t tiles = (size_t)((g[4] - g[2] + g[6] - 1) / g[6]) *
+		               ((g[5] - g[3] + g[6] - 1) / g[6]);
+		size_t pixels = (size_t)g[0] * g[1] * 3;
+		cp->tiles.resize(tiles);
+		cp->pixels.resize(pixels);
+		cp->colors.resize(pixels);
+		ok = fread(cp->tiles.data(), 1, tiles, file) == tiles &&
+		     fread(cp->pixels.data(), 1, pixels, file) == pixels &&
+		     fread(cp->colors.data(), sizeof(float), pixels, file) == pixels;
+	}
+	fclose(file);
+	if (!ok) {
+		traceUI->alert("Checkpoint " + path + " is unreadable or from a different scene or settings");
+		return false;
+	}
+	resume = std::move(cp);
+	return true;
 }
 
 int RayTracer::aaImage()
 {
-	// YOUR CODE HERE
-	// FIXME: Implement Anti-aliasing here
+	// Supersampling already happens per pixel in trace() when
+	// anti-aliasing is switched on, so there is only a second pass to run
+	// after a preview.
 	//
 	// TIP: samples and aaThresh have been synchronized with TraceUI by
 	//      RayTracer::traceSetup() function
-	return 0;
+	waitRender();
+	if (!previewPass)
+		return 0;
+
+	// A tile needs supersampling if some pixel in it differs from a
+	// neighbour by more than the threshold; the rest already look the
+	// same as they would with more samples.  Tiles the preview didn't get
+	// to are traced in full.  Highest contrast goes first, so a deadline
+	// cuts off the tiles where aliasing shows least.
+	std::vector<std::pair<float, int>> contrast;
+	int pixels = 0;
+	for (int t = 0; t < tilesX * tilesY; t++) {
+		int x0 = traceX0 + (t % tilesX) * TILE_SIZE;
+		int y0 = traceY0 + (t / tilesX) * TILE_SIZE;
+		int x1 = std::min(x0 + TILE_SIZE, traceX1);
+		int y1 = std::min(y0 + TILE_SIZE, traceY1);
+		float c = std::numeric_limits<float>::infinity();
+		if (tileDone[t]) {
+			c = 0.0f;
+			for (int y = y0; y < y1; y++)
+				for (int x = x0; x < x1; x++) {
+					const float* p = floatBuffer + (x + (size_t)y * buffer_width) * 3;
+					for (int i = 0; i < 3; i++) {
+						if (x + 1 < traceX1)
+							c = std::max(c, std::abs(p[i] - p[i + 3]));
+						if (y + 1 < traceY1)
+							c = std::max(c, std::abs(p[i] - p[i + buffer_width * 3]));
+					}
+				}
+		}
+		if (c > aaThresh) {
+			contrast.push_back(std::make_pair(c, t));
+			tileDone[t] = false;
+			pixels += (x1 - x0) * (y1 - y0);
+		}
+	}
+	std::stable_sort(contrast.begin(), contrast.end(),
+	                 [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
+		                 return a.first > b.first;
+	                 });
+	tileOrder.clear();
+	for (const auto& tile : contrast)
+		tileOrder.push_back(tile.second);
+
+	previewPass = false;
+	relightPass = false;
+	updatePass = false;
+	startWorkers();
+	return pixels;
+}
+
+bool RayTracer::waitUntil(std::chrono::steady_clock::time_point deadline,
+                          const std::atomic<bool>* cancelled)
+{
+	while (!checkRender()) {
+		auto now = std::chrono::steady_clock::now();
+		if (now >= deadline || (cancelled && *cancelled)) {
+			stopTrace = true;
+			break;
+		}
+		std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+		        deadline - now, std::chrono::milliseconds(1)));
+	}
+	waitRender();
+	return !stopTrace;
+}
+
+double RayTracer::traceWithin(int w, int h,
+                              std::chrono::steady_clock::time_point deadline,
+                              const std::atomic<bool>* cancelled)
+{
+	// Each pass starts by clearing stopTrace, so a cancel is checked
+	// before and during each one rather than relying on the flag.
+	traceImage(w, h, true);
+	if (waitUntil(deadline, cancelled) && !(cancelled && *cancelled))
+		aaImage();
+	waitUntil(deadline, cancelled);
+	return finishedFraction();
+}
+
+double RayTracer::finishedFraction() const
+{
+	if (previewPass || tilesX * tilesY == 0)
+		return 0.0;
+	long long done = 0;
+	for (int t = 0; t < tilesX * tilesY; t++) {
+		if (!tileDone[t])
+			continue;
+		int x0 = traceX0 + (t % tilesX) * TILE_SIZE;
+		int y0 = traceY0 + (t / tilesX) * TILE_SIZE;
+		done += (long long)(std::min(x0 + TILE_SIZE, traceX1) - x0) *
+		        (std::min(y0 + TILE_SIZE, traceY1) - y0);
+	}
+	return (double)done / ((long long)(traceX1 - traceX0) * (traceY1 - traceY0));
 }
 
 bool RayTracer::checkRender()
 {
-	// YOUR CODE HERE
-	// FIXME: Return true if tracing is done.
-	//        This is a helper routine for GUI.
-	//
-	// TIPS: Introduce an array to track the status of each worker thread.
-	//       This array is maintained by the worker threads.
-	return true;
+	return workersDone == workers.size();
 }
 
 void RayTracer::waitRender()
 {
-	// YOUR CODE HERE
-	// FIXME: Wait until the rendering process is done.
-	//        This function is essential if you are using an asynchronous
-	//        traceImage implementation.
-	//
-	// TIPS: Join all worker threads here.
+	for (auto& worker : workers)
+		worker.join();
+	workers.clear();
+	workersDone = 0;
 }
 
 
 glm::dvec3 RayTracer::getPixel(int i, int j)
 {
-	unsigned char *pixel = buffer.data() + ( i + j * buffer_width ) * 3;
+	unsigned char *pixel = buffer + ( i + (size_t)j * buffer_width ) * 3;
 	return glm::dvec3((double)pixel[0]/255.0, (double)pixel[1]/255.0, (double)pixel[2]/255.0);
 }
 
 void RayTracer::setPixel(int i, int j, glm::dvec3 color)
 {
-	unsigned char *pixel = buffer.data() + ( i + j * buffer_width ) * 3;
+	unsigned char *pixel = buffer + ( i + (size_t)j * buffer_width ) * 3;
 
 	pixel[0] = (int)( 255.0 * color[0]);
 	pixel[1] = (int)( 255.0 * color[1]);
 	pixel[2] = (int)( 255.0 * color[2]);
+
+	float *fpixel = floatBuffer + ( i + (size_t)j * buffer_width ) * 3;
+	fpixel[0] = (float)color[0];
+	fpixel[1] = (float)color[1];
+	fpixel[2] = (float)color[2];
 }
 
@@ -7,8 +7,15 @@
 
 #include <time.h>
 #include <glm/vec3.hpp>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <memory>
 #include <queue>
 #include <thread>
+#include <vector>
+#include "fileio/mapped.h"
+#include "scene/animation.h"
 #include "scene/cubeMap.h"
 #include "scene/ray.h"
 #include <mutex>
@@ -36,37 +43,241 @@ public:
 	glm::dvec3 getPixel(int i, int j);
 	void setPixel(int i, int j, glm::dvec3 color);
 	void getBuffer(unsigned char*& buf, int& w, int& h);
+	// Unquantized colors, same layout as getBuffer()
+	void getFloatBuffer(const float*& buf, int& w, int& h);
+	// With cost recording on, what each pixel took over all passes since
+	// traceImage(): microseconds, rays and BVH node visits, in the layout
+	// of getFloatBuffer().  Empty otherwise.
+	void recordCost(bool on) { costRecording = on; }
+	// Keep the pixel buffers of the next images in a scratch file in dir
+	// rather than in memory, for images too big for it; empty for memory.
+	// Rows are written out and dropped from memory as soon as every tile
+	// across them is done, and read back in if they're touched again.
+	// Images kept on disk don't record what updateImage() needs.
+	void keepPixelsOnDisk(const std::string& dir) { pixelDir = dir; }
+	void getCostBuffer(const float*& buf, int& w, int& h);
+	// With AOV recording on, these planes of what each pixel's first
+	// camera ray hit are filled in as it is traced, for compositing.  Each
+	// is laid out like getFloatBuffer() and is all 0 where the ray missed:
+	// the distance to the hit (in all three channels), the shading normal,
+	// the diffuse color kd, the index of the object in the scene plus 1
+	// (all three channels) and the texture coordinates (u, v, 0).  Taken
+	// from one ray rather than averaged, so ids and depths don't blend
+	// across edges.  The last plane is over all of the pixel's samples:
+	// the variance of their mean luminance, and how many there were.
+	// Kept in memory even when the pixels are on disk.
+	enum AOV { AOV_DEPTH, AOV_NORMAL, AOV_ALBEDO, AOV_ID, AOV_UV, AOV_VARIANCE, AOV_COUNT };
+	static const char* aovName(AOV which);
+	void recordAOVs(bool on) { aovRecording = on; }
+	void getAOVBuffer(AOV which, const float*& buf, int& w, int& h);
+	// Filter the noise out of the finished image, guided by the AOVs (see
+	// denoise.h).  Returns false, leaving the image alone, if they weren't
+	// recorded.
+	bool denoiseImage();
 	double aspectRatio();
 
-	void traceImage(int w, int h);
+	// With preview set, every pixel gets a single sample even when
+	// anti-aliasing is on; aaImage() then supersamples the tiles that
+	// need it.
+	void traceImage(int w, int h, bool preview = false);
 	int aaImage();
+	// The image so far is a single-sample preview that aaImage() finishes
+	bool isPreview() const { return previewPass; }
 	bool checkRender();
 	void waitRender();
 
+	// Render as much as fits before the deadline: a preview pass, then
+	// anti-aliasing of the highest-contrast tiles first.  Whatever is in
+	// the buffer at the deadline is the result; returns the fraction of
+	// its pixels that are finished.  Setting *cancelled stops it early.
+	double traceWithin(int w, int h,
+	                   std::chrono::steady_clock::time_point deadline,
+	                   const std::atomic<bool>* cancelled = nullptr);
+	// The fraction of the image that needs no more work: pixels that were
+	// supersampled, or whose tile aaImage() found smooth enough not to need
+	// it (those still have only the preview's single sample).
+	double finishedFraction() const;
+
 	void traceSetup(int w, int h);
+	void syncSettings();
+
+	// Only trace pixels [x0,x1) x [y0,y1) of the buffer (rows counted from
+	// the bottom, like the buffer itself) until the region is cleared.
+	void setRegion(int x0, int y0, int x1, int y1);
+	void clearRegion();
+
+	// Save the pixels and per-tile progress of the render in flight, so
+	// that an interrupted render can pick up where it left off.  The file
+	// is replaced atomically.  The signature identifies the scene and
+	// settings; resumeFrom() rejects checkpoints with a different one, and
+	// the next traceImage() of the same size only traces unfinished tiles.
+	bool writeCheckpoint(const std::string& path, const std::string& signature);
+	bool resumeFrom(const std::string& path, const std::string& signature);
+	int tilesFinished() const;
+	int tileCount() const { return tilesX * tilesY; }
+
+	// Tiles come in rows across the traced region.  Once every tile of a
+	// row is done, buffer rows [y0,y1) are final for this pass and can be
+	// written out while the rest traces.
+	int tileRows() const { return tilesY; }
+	bool tileRowDone(int row, int& y0, int& y1) const;
+
+	// Keep what the rays of every pixel hit, so that when only the lights
+	// change the image can be shaded again without tracing anything but
+	// shadow rays.  Costs memory for every hit of every sample.
+	void keepHits(bool on);
+	// Shade the last image again from its hits under the current lights;
+	// returns right away like traceImage().  Pixels whose hits don't
+	// cover the samples they now need are traced.  Returns false without
+	// doing anything if there are no hits, or they are out of date: a
+	// different image size, depth, anti-aliasing or cubemap, or the
+	// camera or objects have moved since.
+	bool relightImage();
+
+	// Bring the last image up to date with changed render settings by
+	// tracing only the pixels they affect, going by what each pixel's
+	// rays did: how deep they recursed, whether they were cut off by the
+	// depth limit, and whether they escaped to the cubemap.  Returns
+	// right away like traceImage().  If anti-aliasing was just switched
+	// on, the image is left as a preview for aaImage().  Returns false
+	// without doing anything if the image has to be traced from scratch:
+	// a different size, changed supersampling, an unfinished or preview
+	// image, or the scene has changed.
+	bool updateImage(int w, int h);
 
 	bool loadScene(const char* fn);
 	bool sceneLoaded() { return scene != 0; }
 
+	// Parse a scene and build its acceleration structures without making
+	// it current; returns NULL (after alerting the UI) on failure.
+	Scene* readScene(const char* fn);
+	// How long the last readScene() took to parse the file and to build
+	// the acceleration structures, in seconds
+	double parseTime() const { return parseSeconds; }
+	double buildTime() const { return buildSeconds; }
+	// Render a scene that is owned elsewhere, e.g. by a scene cache
+	void setScene(const std::shared_ptr<Scene>& s);
+
+	// Move the loaded scene to the given frame of an animation
+	bool applyFrame(const FrameUpdate& frame);
+
 	void setReady(bool ready) { m_bBufferReady = ready; }
 	bool isReady() const { return m_bBufferReady; }
 
 	const Scene& getScene() { return *scene; }
 
-	bool stopTrace;
+	std::atomic<bool> stopTrace;
 
 private:
-	glm::dvec3 trace(double x, double y);
+	// Luminance moments of a pixel's samples
+	struct SampleStats {
+		int count = 0;
+		double sum = 0.0, sumSq = 0.0;
+	};
+	glm::dvec3 trace(double x, double y, SampleStats* stats = nullptr);
+	glm::dvec3 samplePixel(int i, int j);
+	template <typename Sample>
+	bool supersample(double x, double y, glm::dvec3& ret, Sample sample);
 
-	std::vector<unsigned char> buffer;
+	// Worker loop: claims tiles until none are left or tracing is stopped
+	void traceTiles(unsigned int id);
+	void startWorkers();
+	// Fill tileOrder with the tiles not done yet
+	void scheduleTiles();
+	// Stop the workers if they're still busy at the deadline
+	bool waitUntil(std::chrono::steady_clock::time_point deadline,
+	               const std::atomic<bool>* cancelled = nullptr);
+
+	// Both live in pixelMemory, or in pixelFile when kept on disk
+	unsigned char* buffer;
+	float* floatBuffer;
+	std::vector<float> pixelMemory;
+	std::string pixelDir;
+	ScratchFile pixelFile;
+	// Drop the rows of a finished row of tiles from memory
+	void releaseTileRow(int row);
 	int buffer_width, buffer_height;
-	int bufferSize;
+	size_t bufferSize;
 	unsigned int threads;
 	int block_size;
 	double thresh;
 	double aaThresh;
 	int samples;
-	std::unique_ptr<Scene> scene;
+	std::shared_ptr<Scene> scene;
+	double parseSeconds, buildSeconds;
+
+	// Tile scheduling.  Workers grab the next tile from a shared counter,
+	// so fast tiles don't leave a thread idle while others still work.
+	std::vector<std::thread> workers;
+	std::atomic<int> nextTile;
+	std::atomic<unsigned int> workersDone;
+	int tilesX, tilesY;
+	std::vector<std::atomic<bool>> tileDone;
+	// Tiles to trace this pass, in the order they're handed out
+	std::vector<int> tileOrder;
+	// Set while the buffer only holds single-sample preview pixels
+	bool previewPass;
+	// Set while shading the last image again from its hits
+	bool relightPass;
+	// Set while only tracing the pixels marked in staleBuffer
+	bool updatePass;
+	std::vector<char> staleBuffer;
+
+	// Settings that change what a pixel's rays do
+	struct TraceSettings {
+		int depth;
+		bool aa;
+		int samples;
+		double aaThresh;
+		bool cubemap;
+		unsigned int cubemapVersion;
+		int filterWidth;
+		bool sameSampling(const TraceSettings& o) const;
+		bool sameBackground(const TraceSettings& o) const;
+	};
+	TraceSettings currentSettings() const;
+	// What the last image was traced with
+	TraceSettings traced;
+
+	// What the rays of each pixel ran into, across its samples
+	struct PixelFeatures {
+		enum { TRUNCATED = 1, ESCAPED = 2 };
+		unsigned char depth = 0; // deepest recursion that was traced
+		unsigned char flags = 0;
+	};
+	std::vector<PixelFeatures> pixelFeatures;
+	static thread_local PixelFeatures* features;
+	// Seconds spent on each tile since traceImage().  The next image with
+	// the same tiles hands out the most expensive ones first, so that no
+	// thread picks up a slow tile just as the others run out of work.
+	std::vector<float> tileCost;
+	bool costRecording;
+	std::vector<float> costBuffer;
+	// AOV_COUNT planes of bufferSize floats, one after the other
+	bool aovRecording;
+	std::vector<float> aovBuffer;
+	// The pixel's first entry in aovBuffer while its first camera ray is
+	// yet to be traced, null otherwise
+	static thread_local float* aovPixel;
+	void storeAOVs(const isect& i, bool hit);
+
+	// Hits of the last full-quality image, with keepHits()
+	bool keepingHits;
+	struct HitCache;
+	std::unique_ptr<HitCache> hits;
+	struct PixelHits;
+	// The pixel this thread is tracing, while hits are being kept
+	static thread_local PixelHits* recording;
+	bool relightPixel(const PixelHits& pixel, double x, double y, glm::dvec3& col);
+
+	// Checkpoint read by resumeFrom(), applied by the next traceImage()
+	struct Checkpoint;
+	std::unique_ptr<Checkpoint> resume;
+
+	// Pixels being traced: the requested region, or the whole buffer
+	bool hasRegion;
+	int regionX0, regionY0, regionX1, regionY1;
+	int traceX0, traceY0, traceX1, traceY1;
 
 	bool m_bBufferReady;
 
@@ -0,0 +1,155 @@
+#include "Renderer.h"
+#include "RayTracer.h"
+#include "profile.h"
+
+#include "ui/TraceUI.h"
+#include "ui/json.hpp"
+
+#include <string.h>
+#include <chrono>
+
+using namespace std;
+extern TraceUI* traceUI;
+
+// Holds the settings the tracer asks traceUI for, and keeps alerts as the
+// error message instead of showing them.
+class Renderer::Settings : public TraceUI {
+public:
+	int run() { return 0; }
+	void alert(const string& msg) { error = msg; }
+
+	using TraceUI::loadSettings;
+	using TraceUI::saveSettings;
+	using TraceUI::smartLoadCubemap;
+
+	string error;
+	TraceUI* previous = nullptr;
+};
+
+Renderer::Renderer() : settings(new Settings), tracer(new RayTracer)
+{
+	settings->previous = traceUI;
+	traceUI = settings.get();
+	settings->setRayTracer(tracer.get());
+}
+
+Renderer::~Renderer()
+{
+	// Stop the workers while the settings they read still exist
+	tracer.reset();
+	traceUI = settings->previous;
+}
+
+bool Renderer::configure(const string& json)
+{
+	string saved = settings->saveSettings();
+	try {
+		settings->loadSettings(json);
+	} catch (nlohmann::json::exception& e) {
+		settings->loadSettings(saved);
+		settings->error = string("bad settings: ") + e.what();
+		return false;
+	}
+	return true;
+}
+
+bool Renderer::loadCubemap(const string& file)
+{
+	settings->smartLoadCubemap(file);
+	if (!settings->cubeMap()) {
+		settings->error = "unable to load cubemap " + file;
+		return false;
+	}
+	return true;
+}
+
+bool Renderer::loadScene(const string& path)
+{
+	settings->error.clear();
+	if (tracer->loadScene(path.c_str())) {
+		counters.parseSeconds = tracer->parseTime();
+		counters.buildSeconds = tracer->buildTime();
+		return true;
+	}
+	if (settings->error.empty())
+		settings->error = "unable to load " + path;
+	return false;
+}
+
+bool Renderer::applyFrame(const FrameUpdate& frame)
+{
+	return tracer->applyFrame(frame);
+}
+
+double Renderer::aspectRatio() const
+{
+	return tracer->aspectRatio();
+}
+
+bool Renderer::trace(int width, int height)
+{
+	if (!tracer->sceneLoaded()) {
+		settings->error = "no scene loaded";
+		return false;
+	}
+	if (width <= 0 || height <= 0) {
+		settings->error = "bad image size";
+		return false;
+	}
+	TraceUI::resetCount();
+	TraceUI::resetNodeVisits();
+	auto start = chrono::steady_clock::now();
+	{
+		ProfileScope span("primary pass");
+		if (!tracer->updateImage(width, height))
+			tracer->traceImage(width, height);
+		tracer->waitRender();
+	}
+	// Only an image kept as a preview by updateImage() has an AA pass of
+	// its own; otherwise supersampling was part of the primary pass
+	if (settings->aaSwitch() && tracer->isPreview()) {
+		ProfileScope span("AA pass");
+		tracer->aaImage();
+		tracer->waitRender();
+	}
+	counters.traceSeconds = chrono::duration<double>(
+	        chrono::steady_clock::now() - start).count();
+	counters.rays = TraceUI::getCount();
+	counters.nodeVisits = TraceUI::getNodeVisits();
+	return true;
+}
+
+bool Renderer::render(int width, int height, unsigned char* rgb, size_t stride)
+{
+	if (!trace(width, height))
+		return false;
+	unsigned char* buf;
+	tracer->getBuffer(buf, width, height);
+	size_t row = width * 3;
+	if (stride == 0)
+		stride = row;
+	// The tracer's buffer is bottom-up
+	for (int y = 0; y < height; y++)
+		memcpy(rgb + y * stride, buf + (height - y - 1) * row, row);
+	return true;
+}
+
+bool Renderer::render(int width, int height, float* rgb, size_t stride)
+{
+	if (!trace(width, height))
+		return false;
+	const float* buf;
+	tracer->getFloatBuffer(buf, width, height);
+	size_t row = width * 3;
+	if (stride == 0)
+		stride = row;
+	for (int y = 0; y < height; y++)
+		memcpy(rgb + y * stride, buf + (height - y - 1) * row,
+		       row * sizeof(float));
+	return true;
+}
+
+const string& Renderer::error() const
+{
+	return settings->error;
+}
@@ -0,0 +1,71 @@
+//
+// Renderer.h
+//
+// Interface for programs that embed the tracer rather than run one of its
+// user interfaces: load a scene, then render it into memory owned by the
+// caller.  Nothing here needs FLTK or OpenGL.
+//
+
+#ifndef __RENDERER_H__
+#define __RENDERER_H__
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+#include "scene/animation.h"
+
+class RayTracer;
+
+class Renderer {
+public:
+	// The tracer reads its settings through the global traceUI, which a
+	// Renderer takes over for its lifetime.  Only one Renderer (or UI)
+	// can be active at a time.
+	Renderer();
+	~Renderer();
+
+	// Settings in the -j JSON format, e.g. {"recursion_depth": 3}.  On
+	// malformed input nothing changes and false is returned.
+	bool configure(const std::string& json);
+	// One of the six cubemap faces; the rest are found by name
+	bool loadCubemap(const std::string& file);
+
+	bool loadScene(const std::string& path);
+	// Move the loaded scene to a frame of an animation
+	bool applyFrame(const FrameUpdate& frame);
+	// Width / height of the scene's camera
+	double aspectRatio() const;
+
+	// Trace a width x height image into rgb: height rows, top row first,
+	// each starting stride bytes (or floats) after the previous one.  A
+	// stride of 0 means width * 3.  Returns false if no scene is loaded.
+	// Rendering the same scene at the same size again only traces the
+	// pixels that changed settings affect.
+	bool render(int width, int height, unsigned char* rgb, size_t stride = 0);
+	bool render(int width, int height, float* rgb, size_t stride = 0);
+
+	// What went wrong in the last failed call
+	const std::string& error() const;
+
+	struct Stats {
+		// Last loadScene(): parsing, then building the BVHs
+		double parseSeconds = 0.0;
+		double buildSeconds = 0.0;
+		// Last render()
+		double traceSeconds = 0.0;
+		long long rays = 0;
+		long long nodeVisits = 0;
+	};
+	const Stats& stats() const { return counters; }
+
+private:
+	bool trace(int width, int height);
+
+	class Settings;
+	std::unique_ptr<Settings> settings;
+	std::unique_ptr<RayTracer> tracer;
+	Stats counters;
+};
+
+#endif // __RENDERER_H__
@@ -26,6 +26,7 @@ Trimesh::~Trimesh()
 		delete m;
 	for (auto f : faces)
 		delete f;
+	deleteBVH(root);
 }
 
 // must add vertices, normals, and materials IN ORDER
@@ -82,10 +83,13 @@ bool Trimesh::intersectLocal(ray& r, isect& i) const
 	double tmin = 0.0;
 	double tmax = 0.0;
 	vector<BVH*> s;
-	s.push_back(root);
+	if(root != nullptr)
+		s.push_back(root);
 	bool have_one = false;
+	int visited = 0;
 	while(!s.empty()) {
 		BVH* curr = s[s.size() - 1];
+		visited++;
 		// cout << curr << endl;
 		s.pop_back();
 		if(curr->bounds.intersect(r, tmin, tmax)){
@@ -114,11 +118,23 @@ bool Trimesh::intersectLocal(ray& r, isect& i) const
 	// 		}
 	// 	}
 	// }
+	TraceUI::addNodeVisits(visited, ray_thread_id);
 	if (!have_one)
 		i.setT(1000.0);
 	return have_one;
 }
 
+bool TrimeshInstance::intersectLocal(ray& r, isect& i) const
+{
+	// The ray is already in the instance's local space, which is the
+	// prototype's local space, so the shared face BVH can be used directly.
+	if (!mesh->intersectLocal(r, i))
+		return false;
+	if (overrideMaterial && !mesh->hasPerVertexMaterials())
+		i.setMaterial(*this->material);
+	return true;
+}
+
 bool TrimeshFace::intersect(ray& r, isect& i) const
 {
 	return intersectLocal(r, i);
@@ -191,8 +207,32 @@ void Trimesh::Init(){
 		auto pair = std::make_pair(i, vec);
 		map.insert(pair);
 	}
-	glm::dvec3 axes = findLongestAxis2(map);
-	root = recursiveBuild(map, axes);
+	deleteBVH(root);
+	root = nullptr;
+	if(!map.empty()) {
+		glm::dvec3 axes = findLongestAxis2(map);
+		root = recursiveBuild(map, axes);
+	}
+	buildCost = sahCost(root);
+}
+
+bool Trimesh::setVertices(const Vertices& v)
+{
+	vertices = v;
+	for (auto face : faces)
+		face->update();
+	// Normals read from the scene file can't be recomputed, so only
+	// generated ones follow the new vertices.
+	if (normalsGenerated)
+		generateNormals();
+	ComputeLocalBoundingBox();
+
+	refitBVH(root, [this](int i) { return faces[i]->getBoundingBox(); });
+	if(sahCost(root) > buildCost * traceUI->getRebuildThreshold()) {
+		Init();
+		return true;
+	}
+	return false;
 }
 
 // Intersect ray r with the triangle abc.  If it hits returns true,
@@ -280,7 +320,7 @@ bool TrimeshFace::intersectLocal(ray& r, isect& i) const
 void Trimesh::generateNormals()
 {
 	int cnt = vertices.size();
-	normals.resize(cnt);
+	normals.assign(cnt, glm::dvec3(0.0, 0.0, 0.0));
 	std::vector<int> numFaces(cnt, 0);
 
 	for (auto face : faces) {
@@ -298,5 +338,6 @@ void Trimesh::generateNormals()
 	}
 
 	vertNorms = true;
+	normalsGenerated = true;
 }
 
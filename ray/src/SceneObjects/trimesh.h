@@ -21,9 +21,11 @@
 #include <glm/vec4.hpp>
 
 class TrimeshFace;
+class TrimeshInstance;
 
 class Trimesh : public MaterialSceneObject {
 	friend class TrimeshFace;
+	friend class TrimeshInstance;
 	typedef std::vector<glm::dvec3> Normals;
 	typedef std::vector<glm::dvec3> Vertices;
 	typedef std::vector<TrimeshFace *> Faces;
@@ -39,6 +41,9 @@ public:
 
 	Trimesh(Scene *scene, Material *mat, TransformNode *transform)
 	        : MaterialSceneObject(scene, mat),
+	          root(nullptr),
+	          buildCost(0.0),
+	          normalsGenerated(false),
 	          displayListWithMaterials(0),
 	          displayListWithoutMaterials(0)
 	{
@@ -64,8 +69,22 @@ public:
 	BVH* recursiveBuild(unordered_map<int, glm::dvec3> map, glm::dvec3 axes);
 	void Init();
 	BVH* root;
+	double buildCost; // SAH cost of the face BVH when it was last built
+
+	size_t numVertices() const { return vertices.size(); }
+	const Vertices& getVertices() const { return vertices; }
+	size_t numFaces() const { return faces.size(); }
+
+	// Move the vertices (same count and order as when the mesh was built)
+	// for the next frame of an animation.  Face normals, generated vertex
+	// normals and the face BVH follow along; the BVH is refit, or rebuilt
+	// if refitting has degraded it too much.  Returns true if it was
+	// rebuilt.
+	bool setVertices(const Vertices &v);
 
 	bool hasBoundingBoxCapability() const { return true; }
+	bool hasPerVertexMaterials() const { return !materials.empty(); }
+	const BoundingBox& getLocalBounds() const { return localBounds; }
 
 	BoundingBox ComputeLocalBoundingBox()
 	{
@@ -83,13 +102,15 @@ public:
 			        glm::min(localbounds.getMin(), *viter));
 		}
 		localBounds = localbounds;
-		Init();
+		if (root == nullptr)
+			Init();
 		return localbounds;
 	}
 
 protected:
 	void glDrawLocal(int quality, bool actualMaterials,
 	                 bool actualTextures) const;
+	bool normalsGenerated;
 	mutable int displayListWithMaterials;
 	mutable int displayListWithoutMaterials;
 };
@@ -109,11 +130,16 @@ public:
 		ids[0]       = a;
 		ids[1]       = b;
 		ids[2]       = c;
+		update();
+	}
 
-		// Compute the face normal here, not on the fly
-		glm::dvec3 a_coords = parent->vertices[a];
-		glm::dvec3 b_coords = parent->vertices[b];
-		glm::dvec3 c_coords = parent->vertices[c];
+	// Compute the face normal here, not on the fly.  Called again
+	// whenever the parent's vertices move.
+	void update()
+	{
+		glm::dvec3 a_coords = parent->vertices[ids[0]];
+		glm::dvec3 b_coords = parent->vertices[ids[1]];
+		glm::dvec3 c_coords = parent->vertices[ids[2]];
 
 		glm::dvec3 vab = (b_coords - a_coords);
 		glm::dvec3 vac = (c_coords - a_coords);
@@ -163,4 +189,38 @@ public:
 	const BoundingBox &getBoundingBox() const { return localbounds; }
 };
 
+// A placement of a shared Trimesh under its own transform.  The vertices,
+// faces and face BVH stay with the prototype mesh, so the scene BVH works as
+// the top level over instances and each instance only costs a TransformNode.
+class TrimeshInstance : public MaterialSceneObject {
+	const Trimesh *mesh;
+	bool overrideMaterial;
+
+public:
+	// mat may be NULL, in which case the prototype's material is used
+	TrimeshInstance(Scene *scene, Material *mat, const Trimesh *mesh,
+	                TransformNode *transform)
+	        : MaterialSceneObject(scene,
+	                              mat ? mat : new Material(mesh->getMaterial())),
+	          mesh(mesh),
+	          overrideMaterial(mat != NULL)
+	{
+		this->transform = transform;
+	}
+
+	bool intersectLocal(ray &r, isect &i) const;
+
+	bool hasBoundingBoxCapability() const { return true; }
+
+	// The prototype has already computed its bounds (and built its BVH)
+	// when it was added to the scene.
+	BoundingBox ComputeLocalBoundingBox() { return mesh->getLocalBounds(); }
+
+	const Trimesh *getMesh() const { return mesh; }
+
+protected:
+	void glDrawLocal(int quality, bool actualMaterials,
+	                 bool actualTextures) const;
+};
+
 #endif // TRIMESH_H__
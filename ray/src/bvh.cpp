@@ -1,6 +1,103 @@
 #include "bvh.h"
-#include "scene.h"
 
-BVH::BVH(Scene* scene){
-    cout << "BVH constructor for scene" << endl;
-}
\ No newline at end of file
+#include <glm/common.hpp>
+
+// Relative costs of visiting an interior node vs. intersecting a primitive.
+static const double kTraversalCost = 1.0;
+static const double kIntersectCost = 1.0;
+
+void refitBVH(BVH* node, const std::function<BoundingBox(int)>& leafBounds)
+{
+    if(node == nullptr)
+        return;
+    if(node->isLeaf){
+        node->bounds = leafBounds(node->index);
+        return;
+    }
+    refitBVH(node->left, leafBounds);
+    refitBVH(node->right, leafBounds);
+    BoundingBox merged;
+    if(node->left != nullptr)
+        merged.merge(node->left->bounds);
+    if(node->right != nullptr)
+        merged.merge(node->right->bounds);
+    node->bounds = merged;
+}
+
+static double sahCostHelper(BVH* node, double rootArea)
+{
+    if(node == nullptr)
+        return 0.0;
+    double ratio = node->bounds.area() / rootArea;
+    if(node->isLeaf)
+        return ratio * kIntersectCost;
+    return ratio * kTraversalCost + sahCostHelper(node->left, rootArea) +
+           sahCostHelper(node->right, rootArea);
+}
+
+double sahCost(BVH* root)
+{
+    if(root == nullptr)
+        return 0.0;
+    double rootArea = root->bounds.area();
+    if(rootArea <= 0.0)
+        return 0.0;
+    return sahCostHelper(root, rootArea);
+}
+
+static double surfaceArea(const glm::dvec3& lo, const glm::dvec3& hi)
+{
+    glm::dvec3 d = hi - lo;
+    if(d[0] < 0.0 || d[1] < 0.0 || d[2] < 0.0)
+        return 0.0;
+    return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+static void statsHelper(BVH* node, int depth, BVHStats& stats, double& overlapSum)
+{
+    if(node == nullptr)
+        return;
+    stats.nodes++;
+    if(node->isLeaf){
+        // Leaves point at a single primitive
+        stats.leaves++;
+        stats.primitives++;
+        stats.leafSizes[1]++;
+        if((int)stats.leafDepths.size() <= depth)
+            stats.leafDepths.resize(depth + 1);
+        stats.leafDepths[depth]++;
+        return;
+    }
+    if(node->left != nullptr && node->right != nullptr){
+        const BoundingBox& l = node->left->bounds;
+        const BoundingBox& r = node->right->bounds;
+        double area = surfaceArea(node->bounds.getMin(), node->bounds.getMax());
+        if(area > 0.0)
+            overlapSum += surfaceArea(glm::max(l.getMin(), r.getMin()),
+                                      glm::min(l.getMax(), r.getMax())) / area;
+    }
+    statsHelper(node->left, depth + 1, stats, overlapSum);
+    statsHelper(node->right, depth + 1, stats, overlapSum);
+}
+
+BVHStats bvhStats(BVH* root)
+{
+    BVHStats stats;
+    double overlapSum = 0.0;
+    statsHelper(root, 0, stats, overlapSum);
+    long long interior = stats.nodes - stats.leaves;
+    if(interior > 0)
+        stats.overlap = overlapSum / interior;
+    stats.sah = sahCost(root);
+    stats.bytes = stats.nodes * sizeof(BVH);
+    return stats;
+}
+
+void deleteBVH(BVH* node)
+{
+    if(node == nullptr)
+        return;
+    deleteBVH(node->left);
+    deleteBVH(node->right);
+    delete node;
+}
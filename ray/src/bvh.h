@@ -2,6 +2,9 @@
 
 #include "scene/bbox.h"
 #include <iostream>
+#include <functional>
+#include <map>
+#include <vector>
 #include <glm/vec3.hpp>
 
 class BVH{
@@ -10,4 +13,32 @@ class BVH{
         BVH *left, *right;
         bool isLeaf;
         int index;
-};
\ No newline at end of file
+};
+
+// Recompute every node's bounds bottom-up from the current bounds of the
+// primitives its leaves point at.  The topology is left untouched, so this is
+// only a good tree as long as primitives don't move too far.
+void refitBVH(BVH* node, const std::function<BoundingBox(int)>& leafBounds);
+
+// Surface area heuristic cost of the tree, normalized by the root's area.
+// Used to decide when a refitted tree has degraded enough to rebuild.
+double sahCost(BVH* root);
+
+// Shape of a built tree, for comparing builders
+struct BVHStats {
+    long long nodes = 0;
+    long long leaves = 0;
+    long long primitives = 0;
+    // Leaves at each depth (the root is depth 0)
+    std::vector<long long> leafDepths;
+    // Number of leaves holding each number of primitives
+    std::map<int, long long> leafSizes;
+    double sah = 0.0;
+    // Mean over interior nodes of the area where the two children overlap,
+    // relative to the node's area.  Rays through that part visit both.
+    double overlap = 0.0;
+    size_t bytes = 0;
+};
+BVHStats bvhStats(BVH* root);
+
+void deleteBVH(BVH* node);
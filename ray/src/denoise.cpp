@@ -0,0 +1,255 @@
+#include "denoise.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Run work(y0, y1) over bands of rows on the given number of threads
+void parallelRows(int height, unsigned int threads,
+                  const std::function<void(int, int)>& work)
+{
+	threads = std::max(1u, std::min(threads, (unsigned int)height));
+	std::vector<std::thread> pool;
+	for (unsigned int t = 1; t < threads; t++)
+		pool.emplace_back(work, (int)((long long)height * t / threads),
+		                  (int)((long long)height * (t + 1) / threads));
+	work(0, (int)((long long)height / threads));
+	for (auto& thread : pool)
+		thread.join();
+}
+
+inline float luminance(float r, float g, float b)
+{
+	return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// e^-x for x >= 0, to about 1e-4.  Unlike std::exp it is plain arithmetic
+// the compiler can vectorize.
+inline float negExp(float x)
+{
+	// As a power of 2, offset by the exponent bias so that truncating
+	// rounds down
+	float t = 127.0f - x * 1.44269504f;
+	t = 0.5f * (t + 1.0f + std::abs(t - 1.0f)); // max(t, 1)
+	int32_t whole = (int32_t)t;
+	float f = t - whole;
+	// 2^f on [0, 1)
+	float p = 1.0f + f * (0.69583356f + f * (0.22606716f + f * 0.078024523f));
+	int32_t bits = whole << 23;
+	float scale;
+	std::memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+// Add one tap of the filter to the sums for count pixels of a row.  p*
+// are the pixels themselves, q* the ones the tap lands on, and s* the
+// running sums, all starting at the first of the pixels.  None of them
+// overlap, which __restrict tells the compiler so that the loop
+// vectorizes.
+void accumulateTap(int count, float k, float invReach,
+                   const float* __restrict pnx, const float* __restrict pny,
+                   const float* __restrict pnz, const float* __restrict pz,
+                   const float* __restrict pid, const float* __restrict pl,
+                   const float* __restrict pscale, const float* __restrict pzScale,
+                   const float* __restrict qr, const float* __restrict qg,
+                   const float* __restrict qb, const float* __restrict qv,
+                   const float* __restrict qnx, const float* __restrict qny,
+                   const float* __restrict qnz, const float* __restrict qz,
+                   const float* __restrict qid, float* __restrict sw,
+                   float* __restrict sr, float* __restrict sg,
+                   float* __restrict sb, float* __restrict sv)
+{
+	for (int x = 0; x < count; x++) {
+		float cosine = pnx[x] * qnx[x] + pny[x] * qny[x] + pnz[x] * qnz[x];
+		cosine = 0.5f * (cosine + std::abs(cosine)); // max(cosine, 0)
+		// cosine^128
+		float wn = cosine * cosine;
+		wn *= wn;
+		wn *= wn;
+		wn *= wn;
+		wn *= wn;
+		wn *= wn;
+		wn *= wn;
+		float ql = luminance(qr[x], qg[x], qb[x]);
+		// A different object counts as an edge too steep to cross
+		float e = std::abs(pz[x] - qz[x]) * pzScale[x] * invReach +
+		          std::abs(pl[x] - ql) * pscale[x] + std::abs(pid[x] - qid[x]) * 1e4f;
+		float w = k * wn * negExp(e);
+		sw[x] += w;
+		sr[x] += w * qr[x];
+		sg[x] += w * qg[x];
+		sb[x] += w * qb[x];
+		sv[x] += w * w * qv[x];
+	}
+}
+
+// The filter works on one plane per channel, so that its inner loops run
+// over contiguous floats and vectorize.
+struct Planes {
+	Planes(size_t n) : r(n), g(n), b(n), var(n) {}
+	std::vector<float> r, g, b, var;
+};
+
+} // anonymous namespace
+
+void denoise(int width, int height, float* rgb, const float* normal,
+             const float* albedo, const float* depth, const float* id,
+             const float* variance, const DenoiseSettings& settings)
+{
+	size_t n = (size_t)width * height;
+	if (n == 0)
+		return;
+
+	// Demodulate.  Black albedo (mirrors, lights) is left as it is.
+	Planes in(n), out(n);
+	std::vector<float> divisor(n * 3);
+	std::vector<float> nx(n), ny(n), nz(n), z(n), object(n);
+	for (size_t p = 0; p < n; p++) {
+		for (int c = 0; c < 3; c++)
+			divisor[p * 3 + c] = albedo[p * 3 + c] > 1e-3f ? albedo[p * 3 + c] : 1.0f;
+		in.r[p] = rgb[p * 3] / divisor[p * 3];
+		in.g[p] = rgb[p * 3 + 1] / divisor[p * 3 + 1];
+		in.b[p] = rgb[p * 3 + 2] / divisor[p * 3 + 2];
+		nx[p] = normal[p * 3];
+		ny[p] = normal[p * 3 + 1];
+		nz[p] = normal[p * 3 + 2];
+		z[p] = depth[p * 3];
+		object[p] = id[p * 3];
+	}
+
+	// How fast depth changes across each pixel, which scales how big a
+	// depth difference counts as an edge
+	std::vector<float> dz(n);
+	parallelRows(height, settings.threads, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++)
+			for (int x = 0; x < width; x++) {
+				size_t p = (size_t)y * width + x;
+				float gx = std::abs(z[y * width + std::min(x + 1, width - 1)] -
+				                    z[y * width + std::max(x - 1, 0)]) * 0.5f;
+				float gy = std::abs(z[std::min(y + 1, height - 1) * (size_t)width + x] -
+				                    z[std::max(y - 1, 0) * (size_t)width + x]) * 0.5f;
+				dz[p] = std::max(gx, gy);
+			}
+	});
+
+	// Variance: measured where there were samples to measure it from,
+	// otherwise from the 3x3 neighbours on the same object
+	parallelRows(height, settings.threads, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++)
+			for (int x = 0; x < width; x++) {
+				size_t p = (size_t)y * width + x;
+				if (variance[p * 3 + 1] >= 2.0f) {
+					in.var[p] = variance[p * 3];
+					continue;
+				}
+				float sum = 0.0f, sumSq = 0.0f, count = 0.0f;
+				for (int j = std::max(y - 1, 0); j <= std::min(y + 1, height - 1); j++)
+					for (int i = std::max(x - 1, 0); i <= std::min(x + 1, width - 1); i++) {
+						size_t q = (size_t)j * width + i;
+						if (object[q] != object[p])
+							continue;
+						float l = luminance(in.r[q], in.g[q], in.b[q]);
+						sum += l;
+						sumSq += l * l;
+						count += 1.0f;
+					}
+				float mean = sum / count;
+				in.var[p] = std::max(sumSq / count - mean * mean, 0.0f);
+			}
+	});
+
+	static const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+	std::vector<float> smoothVar(n);
+	for (int pass = 0; pass < settings.passes; pass++) {
+		int step = 1 << pass;
+
+		// Colors are compared against the noise level around the pixel,
+		// which a single pixel's variance estimates poorly
+		parallelRows(height, settings.threads, [&](int y0, int y1) {
+			for (int y = y0; y < y1; y++)
+				for (int x = 0; x < width; x++) {
+					float sum = 0.0f, weight = 0.0f;
+					for (int j = -1; j <= 1; j++)
+						for (int i = -1; i <= 1; i++) {
+							int qx = x + i, qy = y + j;
+							if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+								continue;
+							float k = kernel[i + 2] * kernel[j + 2];
+							sum += k * in.var[(size_t)qy * width + qx];
+							weight += k;
+						}
+					smoothVar[(size_t)y * width + x] = sum / weight;
+				}
+		});
+
+		parallelRows(height, settings.threads, [&](int y0, int y1) {
+			std::vector<float> lum(width), scale(width), zScale(width);
+			std::vector<float> sw(width), sr(width), sg(width), sb(width), sv(width);
+			for (int y = y0; y < y1; y++) {
+				size_t row = (size_t)y * width;
+				for (int x = 0; x < width; x++) {
+					size_t p = row + x;
+					lum[x] = luminance(in.r[p], in.g[p], in.b[p]);
+					scale[x] = 1.0f / (settings.sigmaColor * std::sqrt(smoothVar[p]) + 1e-6f);
+					zScale[x] = 1.0f / (settings.sigmaDepth * dz[p] * step + 1e-6f);
+					// The center tap, which also keeps sw from being 0
+					float k = kernel[2] * kernel[2];
+					sw[x] = k;
+					sr[x] = k * in.r[p];
+					sg[x] = k * in.g[p];
+					sb[x] = k * in.b[p];
+					sv[x] = k * k * in.var[p];
+				}
+
+				// One tap at a time across the whole row
+				for (int j = -2; j <= 2; j++) {
+					int qy = y + j * step;
+					if (qy < 0 || qy >= height)
+						continue;
+					size_t qrow = (size_t)qy * width;
+					for (int i = -2; i <= 2; i++) {
+						if (i == 0 && j == 0)
+							continue;
+						int dx = i * step;
+						// Only the pixels whose tap lands inside the row,
+						// so no pointer is ever made outside it
+						int x0 = std::max(0, -dx), x1 = std::min(width, width - dx);
+						if (x0 >= x1)
+							continue;
+						size_t p = row + x0, q = qrow + x0 + dx;
+						accumulateTap(x1 - x0, kernel[i + 2] * kernel[j + 2],
+						              1.0f / (std::abs(i) + std::abs(j)),
+						              &nx[p], &ny[p], &nz[p], &z[p], &object[p], &lum[x0],
+						              &scale[x0], &zScale[x0], &in.r[q], &in.g[q],
+						              &in.b[q], &in.var[q], &nx[q], &ny[q], &nz[q], &z[q],
+						              &object[q], &sw[x0], &sr[x0], &sg[x0],
+						              &sb[x0], &sv[x0]);
+					}
+				}
+
+				for (int x = 0; x < width; x++) {
+					size_t p = row + x;
+					float inv = 1.0f / sw[x];
+					out.r[p] = sr[x] * inv;
+					out.g[p] = sg[x] * inv;
+					out.b[p] = sb[x] * inv;
+					out.var[p] = sv[x] * inv * inv;
+				}
+			}
+		});
+		std::swap(in, out);
+	}
+
+	// Remodulate
+	for (size_t p = 0; p < n; p++) {
+		rgb[p * 3] = std::min(std::max(in.r[p] * divisor[p * 3], 0.0f), 1.0f);
+		rgb[p * 3 + 1] = std::min(std::max(in.g[p] * divisor[p * 3 + 1], 0.0f), 1.0f);
+		rgb[p * 3 + 2] = std::min(std::max(in.b[p] * divisor[p * 3 + 2], 0.0f), 1.0f);
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+// Edge-avoiding a-trous wavelet filter, after "Edge-Avoiding A-Trous Wavelet
+// Transform for fast Global Illumination Filtering" (Dammertz et al. 2010)
+// and its use in SVGF (Schied et al. 2017), guided by the AOV planes the
+// tracer records.
+//
+// Colors are divided by the albedo before filtering and multiplied back
+// after, so texture and material detail survive; what gets smoothed is the
+// lighting.  Each pass blends every pixel with 5x5 others spaced twice as
+// far apart as in the pass before, weighted by how alike their normals,
+// depths and colors are.  Colors only count as different relative to the
+// pixel's noise, its variance, so a pixel that was already clean is left
+// alone.  Nothing is blended across objects.
+
+struct DenoiseSettings {
+	int passes = 5;
+	float sigmaColor = 4.0f; // in standard deviations of the noise
+	float sigmaDepth = 1.0f; // in multiples of the local depth gradient
+	unsigned int threads = 1;
+};
+
+// All planes are laid out like RayTracer::getFloatBuffer(), three floats a
+// pixel, and are as described with RayTracer::AOV.  variance holds the
+// variance of each pixel's mean luminance and its number of samples; where
+// a pixel had only one, its variance is estimated from its neighbours on
+// the same object.  rgb is filtered in place.
+void denoise(int width, int height, float* rgb, const float* normal,
+             const float* albedo, const float* depth, const float* id,
+             const float* variance, const DenoiseSettings& settings);
@@ -0,0 +1,140 @@
+#include "exr.h"
+#include "images.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using std::string;
+
+namespace {
+
+// EXR is little endian throughout
+bool bigEndian()
+{
+	uint16_t probe = 1;
+	unsigned char first;
+	memcpy(&first, &probe, 1);
+	return first == 0;
+}
+
+void put(string& out, const void* value, size_t size)
+{
+	const char* bytes = (const char*)value;
+	if (bigEndian())
+		for (size_t i = size; i-- > 0;)
+			out += bytes[i];
+	else
+		out.append(bytes, size);
+}
+
+template <typename T>
+void put(string& out, T value)
+{
+	put(out, &value, sizeof(value));
+}
+
+void attribute(string& out, const char* name, const char* type, const string& value)
+{
+	out.append(name, strlen(name) + 1);
+	out.append(type, strlen(type) + 1);
+	put(out, (int32_t)value.size());
+	out += value;
+}
+
+class EXRWriter : public ImageWriter {
+public:
+	EXRWriter(FILE* file, int width, int height)
+	        : ImageWriter(width, height), file(file)
+	{
+		string header;
+		put(header, (int32_t)20000630); // magic
+		put(header, (int32_t)2);        // version 2, single part scanlines
+
+		// Channels are stored in alphabetical order
+		string channels;
+		for (const char* name : { "B", "G", "R" }) {
+			channels.append(name, 2);
+			put(channels, (int32_t)2); // FLOAT
+			put(channels, (int32_t)0); // pLinear and reserved
+			put(channels, (int32_t)1); // x sampling
+			put(channels, (int32_t)1); // y sampling
+		}
+		channels += '\0';
+		attribute(header, "channels", "chlist", channels);
+		attribute(header, "compression", "compression", string(1, '\0'));
+		string window;
+		put(window, (int32_t)0);
+		put(window, (int32_t)0);
+		put(window, (int32_t)(width - 1));
+		put(window, (int32_t)(height - 1));
+		attribute(header, "dataWindow", "box2i", window);
+		attribute(header, "displayWindow", "box2i", window);
+		attribute(header, "lineOrder", "lineOrder", string(1, '\0')); // top down
+		string one, center;
+		put(one, 1.0f);
+		put(center, 0.0f);
+		put(center, 0.0f);
+		attribute(header, "pixelAspectRatio", "float", one);
+		attribute(header, "screenWindowCenter", "v2f", center);
+		attribute(header, "screenWindowWidth", "float", one);
+		header += '\0';
+
+		// One scanline per chunk, each a y coordinate, a size, then the
+		// row of each channel
+		start = header.size() + (long)height * sizeof(uint64_t);
+		for (int y = 0; y < height; y++)
+			put(header, (uint64_t)(start + (long)y * chunkSize()));
+		ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+	}
+	~EXRWriter() { close(); }
+
+	bool isFloat() const { return true; }
+	using ImageWriter::writeRows;
+
+	bool writeRows(int y0, int y1, const float *rgb)
+	{
+		string chunk;
+		for (int y = y0; ok && y < y1; y++) {
+			// Our rows count from the bottom, EXR's from the top
+			int line = height - 1 - y;
+			const float* row = rgb + (size_t)(y - y0) * width * 3;
+			chunk.clear();
+			put(chunk, (int32_t)line);
+			put(chunk, (int32_t)(width * 3 * sizeof(float)));
+			for (int c = 2; c >= 0; c--)
+				for (int x = 0; x < width; x++)
+					put(chunk, row[x * 3 + c]);
+			ok = fseek(file, start + (long)line * chunkSize(), SEEK_SET) == 0 &&
+			     fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+			rows++;
+		}
+		return ok;
+	}
+
+	bool close()
+	{
+		if (file) {
+			ok = fclose(file) == 0 && ok && rows == height;
+			file = nullptr;
+		}
+		return ok;
+	}
+
+private:
+	long chunkSize() const { return 8 + (long)width * 3 * sizeof(float); }
+
+	FILE* file;
+	long start;
+	int rows = 0;
+	bool ok;
+};
+
+} // anonymous namespace
+
+ImageWriter* openEXR(const char *fname, int width, int height)
+{
+	FILE* file = fopen(fname, "wb");
+	return file ? new EXRWriter(file, width, height) : nullptr;
+}
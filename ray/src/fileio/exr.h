@@ -0,0 +1,14 @@
+#ifndef FILEIO_EXR_H
+#define FILEIO_EXR_H
+
+class ImageWriter;
+
+/*
+ * OpenEXR, the simplest kind: one part of uncompressed float R, G and B
+ * scanlines.  Any EXR reader opens it, and since every scanline has a fixed
+ * size and place it can be written a band at a time in any order (see
+ * ImageWriter in images.h).
+ */
+extern ImageWriter* openEXR(const char *fname, int width, int height);
+
+#endif
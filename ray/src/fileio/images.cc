@@ -1,6 +1,9 @@
 #include "images.h"
 #include "bitmap.h"
 #include "pngimage.h"
+#include "pfm.h"
+#include "exr.h"
+#include <algorithm>
 #include <string>
 #if defined(_MSC_VER)
 #define strncasecmp _strnicmp
@@ -22,11 +25,14 @@ struct Backend {
 	const char* ext;
 	std::vector<uint8_t> (*reader)(const char *fname, int& width, int& height);
 	void (*writer)(const char *iname, int width, int height, const void *data);
+	ImageWriter* (*streamer)(const char *fname, int width, int height);
 };
 
 Backend backends[] = {
-	{".bmp", readBMP, writeBMP},
-	{".png", readPNG, writePNG},
+	{".bmp", readBMP, writeBMP, NULL},
+	{".png", readPNG, writePNG, openPNG},
+	{".pfm", NULL, NULL, openPFM},
+	{".exr", NULL, NULL, openEXR},
 };
 
 const Backend* bmp_handler = &backends[0];
@@ -51,7 +57,7 @@ const Backend* find_handler(const char* fname)
 std::vector<uint8_t> readImage(const char *fname, int& width, int& height)
 {
 	auto handler = find_handler(fname);
-	if (!handler)
+	if (!handler || !handler->reader)
 		return std::vector<uint8_t>();
 	return handler->reader(fname, width, height);
 }
@@ -64,5 +70,49 @@ void writeImage(const char *fname, int width, int height, const void* data)
 			<< ", writing bmp format" << std::endl;
 		handler = bmp_handler;
 	}
-	handler->writer(fname, width, height, data);
+	if (handler->writer) {
+		handler->writer(fname, width, height, data);
+		return;
+	}
+
+	std::unique_ptr<ImageWriter> out(handler->streamer(fname, width, height));
+	if (!out || !out->writeRows(0, height, (const uint8_t*)data) || !out->close())
+		std::cerr << "Error writing " << fname << std::endl;
+}
+
+// Same quantization as the tracer's 8-bit buffer.  Bytes are small
+// enough to convert the band in one go, so the writer sees it whole.
+bool ImageWriter::writeRows(int y0, int y1, const float *rgb)
+{
+	std::vector<uint8_t> rows((size_t)(y1 - y0) * width * 3);
+	for (size_t i = 0; i < rows.size(); i++)
+		rows[i] = (uint8_t)(255.0f * std::min(std::max(rgb[i], 0.0f), 1.0f));
+	return writeRows(y0, y1, rows.data());
+}
+
+// A row at a time, floats being four times the size
+bool ImageWriter::writeRows(int y0, int y1, const uint8_t *rgb)
+{
+	std::vector<float> row(width * 3);
+	for (int y = y0; y < y1; y++, rgb += width * 3) {
+		for (int i = 0; i < width * 3; i++)
+			row[i] = rgb[i] / 255.0f;
+		if (!writeRows(y, y + 1, row.data()))
+			return false;
+	}
+	return true;
+}
+
+std::unique_ptr<ImageWriter> openImageWriter(const char *fname, int width, int height)
+{
+	auto handler = find_handler(fname);
+	if (!handler || !handler->streamer)
+		return nullptr;
+	return std::unique_ptr<ImageWriter>(handler->streamer(fname, width, height));
+}
+
+bool canStreamImage(const char *fname)
+{
+	auto handler = find_handler(fname);
+	return handler && handler->streamer;
 }
@@ -1,16 +1,46 @@
 #ifndef FILEIO_IMAGES_H
 #define FILEIO_IMAGES_H
 
+#include <memory>
 #include <vector>
 #include <stdint.h>
 
 /*
  * Improved readBMP/writeBMP.
  * Automatically detects extensions and read/write the data.
- * Currently supports: bmp, png
+ * Currently supports: bmp, png; and for writing only, the float formats
+ * pfm and exr (uncompressed scanlines).  png, pfm and exr can also be
+ * written a band of rows at a time with openImageWriter().
  * 
  */
 extern std::vector<uint8_t> readImage(const char *fname, int& width, int& height);
 extern void writeImage(const char *iname, int width, int height, const void *data); 
 
+/*
+ * Writes RGB a band of rows at a time, so an image can go out while it is
+ * being traced.  Rows are counted from the bottom, like the tracer's
+ * buffers; a band is rows y0 up to y1, bottom first, width * 3 samples
+ * each.  Bands may come in any order, each row once.
+ *
+ * Float formats take linear floats, the others bytes; either kind of row
+ * is accepted and converted if need be.
+ */
+class ImageWriter {
+public:
+	ImageWriter(int width, int height) : width(width), height(height) {}
+	virtual ~ImageWriter() {}
+	virtual bool isFloat() const = 0;
+	virtual bool writeRows(int y0, int y1, const float *rgb);
+	virtual bool writeRows(int y0, int y1, const uint8_t *rgb);
+	// False if anything failed to write
+	virtual bool close() = 0;
+
+protected:
+	const int width, height;
+};
+
+// Null if fname's format can't be written in bands, or can't be created
+extern std::unique_ptr<ImageWriter> openImageWriter(const char *fname, int width, int height);
+extern bool canStreamImage(const char *fname);
+
 #endif
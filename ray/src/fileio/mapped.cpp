@@ -0,0 +1,133 @@
+#include "mapped.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+#ifndef _MSC_VER
+	if (mapped)
+		munmap((void*)bytes, length);
+#endif
+}
+
+bool MappedFile::open(const char *fname)
+{
+#ifndef _MSC_VER
+	int fd = ::open(fname, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void* p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	bytes = (const uint8_t*)p;
+	length = st.st_size;
+	mapped = true;
+	return true;
+#else
+	FILE* file = fopen(fname, "rb");
+	if (!file)
+		return false;
+	fseek(file, 0, SEEK_END);
+	long end = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	bool ok = end > 0;
+	if (ok) {
+		copy.resize(end);
+		ok = fread(copy.data(), 1, copy.size(), file) == copy.size();
+	}
+	fclose(file);
+	bytes = copy.data();
+	length = copy.size();
+	return ok;
+#endif
+}
+
+bool ScratchFile::create(const std::string& dir, size_t size)
+{
+	close();
+#ifndef _MSC_VER
+	std::string name = dir + "/ray-framebuffer-XXXXXX";
+	std::vector<char> path(name.begin(), name.end());
+	path.push_back('\0');
+	fd = mkstemp(path.data());
+	if (fd < 0)
+		return false;
+	unlink(path.data());
+	// Every block is allocated up front: a sparse file would leave a full
+	// disk to show up as SIGBUS on some later write to the mapping.
+	void* p = MAP_FAILED;
+	if (posix_fallocate(fd, 0, size) == 0)
+		p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	bytes = (uint8_t*)p;
+	length = size;
+	return true;
+#else
+	copy.assign(size, 0);
+	bytes = copy.data();
+	length = size;
+	return true;
+#endif
+}
+
+void ScratchFile::clear()
+{
+#ifdef __linux__
+	// Zeroing the blocks in the file system is far cheaper than writing
+	// every page.  Whatever was cached is dropped with them.
+	if (fd >= 0 && fallocate(fd, FALLOC_FL_ZERO_RANGE, 0, length) == 0)
+		return;
+	if (fd >= 0 &&
+	    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, length) == 0 &&
+	    posix_fallocate(fd, 0, length) == 0)
+		return;
+#endif
+	std::fill(bytes, bytes + length, 0);
+}
+
+void ScratchFile::close()
+{
+#ifndef _MSC_VER
+	if (fd >= 0) {
+		munmap(bytes, length);
+		::close(fd);
+		fd = -1;
+	}
+#endif
+	copy.clear();
+	bytes = nullptr;
+	length = 0;
+}
+
+void ScratchFile::release(size_t offset, size_t size)
+{
+#ifndef _MSC_VER
+	if (fd < 0)
+		return;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t begin = (offset + page - 1) / page * page;
+	size_t end = std::min(offset + size, length) / page * page;
+	if (begin >= end)
+		return;
+	// Written out first, so that dropping them from the page cache too
+	// really frees the memory
+	msync(bytes + begin, end - begin, MS_SYNC);
+	madvise(bytes + begin, end - begin, MADV_DONTNEED);
+	posix_fadvise(fd, begin, end - begin, POSIX_FADV_DONTNEED);
+#endif
+}
@@ -0,0 +1,68 @@
+#ifndef FILEIO_MAPPED_H
+#define FILEIO_MAPPED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * A whole file, read only.  It is memory-mapped where the platform allows,
+ * so pages are only read from disk as they're touched and are shared with
+ * other processes mapping the same file; elsewhere it is read in.
+ */
+class MappedFile {
+public:
+	MappedFile() {}
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const char *fname);
+
+	const uint8_t* data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	const uint8_t* bytes = nullptr;
+	size_t length = 0;
+	bool mapped = false;
+	std::vector<uint8_t> copy;
+};
+
+/*
+ * Writable scratch memory in a file, for data that may not fit in memory.
+ * The file is deleted as soon as it is made, so it goes with the process,
+ * and starts out zeroed with all its disk space allocated, so running out
+ * of space is an error from create() rather than a crash on some later
+ * write.  Pages are written back and dropped by
+ * the kernel as it sees fit; release() says a range won't be needed for a
+ * while.  Where files can't be mapped it is plain memory.
+ */
+class ScratchFile {
+public:
+	ScratchFile() {}
+	~ScratchFile() { close(); }
+	ScratchFile(const ScratchFile&) = delete;
+	ScratchFile& operator=(const ScratchFile&) = delete;
+
+	bool create(const std::string& dir, size_t size);
+	// Zero it all again
+	void clear();
+	void close();
+
+	uint8_t* data() const { return bytes; }
+	size_t size() const { return length; }
+
+	// Write out the whole pages within [offset, offset + size) and drop
+	// them from memory.  They are read back in if touched again.
+	void release(size_t offset, size_t size);
+
+private:
+	uint8_t* bytes = nullptr;
+	size_t length = 0;
+	int fd = -1;
+	std::vector<uint8_t> copy;
+};
+
+#endif
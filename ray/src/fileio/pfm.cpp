@@ -0,0 +1,66 @@
+#include "pfm.h"
+#include "images.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+// Every row has a fixed place after the header, so bands can be written
+// in any order.
+class PFMWriter : public ImageWriter {
+public:
+	PFMWriter(FILE* file, int width, int height)
+	        : ImageWriter(width, height), file(file)
+	{
+		// The sign of the scale gives the byte order of the floats
+		uint16_t probe = 1;
+		unsigned char first;
+		memcpy(&first, &probe, 1);
+		ok = fprintf(file, "PF\n%d %d\n%s\n", width, height,
+		             first ? "-1.0" : "1.0") > 0;
+		start = ftell(file);
+	}
+	~PFMWriter() { close(); }
+
+	bool isFloat() const { return true; }
+	using ImageWriter::writeRows;
+
+	bool writeRows(int y0, int y1, const float *rgb)
+	{
+		size_t count = (size_t)(y1 - y0) * width * 3;
+		ok = ok && fseek(file, start + (long)y0 * width * 3 * sizeof(float), SEEK_SET) == 0 &&
+		     fwrite(rgb, sizeof(float), count, file) == count;
+		rows += y1 - y0;
+		return ok;
+	}
+
+	bool close()
+	{
+		if (file) {
+			ok = fclose(file) == 0 && ok && rows == height;
+			file = nullptr;
+		}
+		return ok;
+	}
+
+private:
+	FILE* file;
+	long start;
+	int rows = 0;
+	bool ok;
+};
+
+} // anonymous namespace
+
+ImageWriter* openPFM(const char *fname, int width, int height)
+{
+	FILE* file = fopen(fname, "wb");
+	return file ? new PFMWriter(file, width, height) : nullptr;
+}
+
+bool writePFM(const char *fname, int width, int height, const float *rgb)
+{
+	std::unique_ptr<ImageWriter> out(openPFM(fname, width, height));
+	return out && out->writeRows(0, height, rgb) && out->close();
+}
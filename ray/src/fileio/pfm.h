@@ -0,0 +1,16 @@
+#ifndef FILEIO_PFM_H
+#define FILEIO_PFM_H
+
+class ImageWriter;
+
+/*
+ * Portable float map: a short text header followed by RGB floats, rows from
+ * the bottom up like the tracer's buffers.  Unlike png or bmp nothing is
+ * clamped or quantized, so it suits data that isn't a picture, such as the
+ * per-pixel cost buffer.
+ */
+extern bool writePFM(const char *fname, int width, int height, const float *rgb);
+// Streaming, see ImageWriter in images.h
+extern ImageWriter* openPFM(const char *fname, int width, int height);
+
+#endif
@@ -1,8 +1,15 @@
 #include "pngimage.h"
+#include "images.h"
 #include <zlib.h>
 #include <png.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string>
 
@@ -216,71 +223,311 @@ std::vector<uint8_t> readPNG(const char *fname, int& width, int& height)
 	return data;
 }
 
+namespace {
+
+// Writes the image data as a series of independent deflate streams, one per
+// band of rows, ended by a sync flush so that they concatenate into one
+// valid zlib stream.  Bands are filtered and compressed on a few threads as
+// they come in, in any order, and each goes out as an IDAT chunk as soon as
+// the bands above it have.  The adler32 checksum of the whole stream is
+// combined from those of the bands at the end.
+//
+// A band can't refer to the row above it, which may not be there yet, so its
+// first row only gets the None or Sub filter; and the window starts empty
+// for every band.  Both cost a little compression, far less than a serial
+// deflate over the whole image costs in time.
+class PNGWriter : public ImageWriter {
+public:
+	static const int BAND_ROWS = 32;
+
+	PNGWriter(FILE* file, int width, int height)
+	        : ImageWriter(width, height), file(file)
+	{
+		static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+		ok = fwrite(signature, 1, 8, file) == 8;
+		std::vector<uint8_t> ihdr;
+		putBE(ihdr, width);
+		putBE(ihdr, height);
+		// 8 bits per sample, RGB, deflate, adaptive filtering, no interlace
+		ihdr.insert(ihdr.end(), { 8, 2, 0, 0, 0 });
+		chunk("IHDR", ihdr);
+		// zlib header: deflate with a 32K window, no dictionary
+		chunk("IDAT", std::vector<uint8_t>{ 0x78, 0x9c });
+
+		unsigned int n = std::max(1u, std::min(std::thread::hardware_concurrency(), 8u));
+		for (unsigned int i = 0; i < n; i++)
+			workers.emplace_back(&PNGWriter::work, this);
+	}
+	~PNGWriter() { close(); }
+
+	bool isFloat() const { return false; }
+	using ImageWriter::writeRows;
+
+	bool writeRows(int y0, int y1, const uint8_t *rgb)
+	{
+		size_t stride = (size_t)width * 3;
+		std::lock_guard<std::mutex> guard(lock);
+		for (int y = y0; y < y1; y += BAND_ROWS) {
+			Band band;
+			band.y0 = y;
+			band.y1 = std::min(y + BAND_ROWS, y1);
+			band.rows.assign(rgb + (y - y0) * stride, rgb + (band.y1 - y0) * stride);
+			queue.push_back(std::move(band));
+		}
+		wake.notify_all();
+		return ok;
+	}
+
+	bool close()
+	{
+		if (!file)
+			return ok;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			closing = true;
+			wake.notify_all();
+		}
+		for (auto& worker : workers)
+			worker.join();
+		workers.clear();
+
+		// Every row has to have gone out, the last band finishing the stream
+		ok = ok && nextRow == height;
+		std::vector<uint8_t> trailer;
+		putBE(trailer, (int)checksum);
+		chunk("IDAT", trailer);
+		chunk("IEND", std::vector<uint8_t>());
+		ok = fclose(file) == 0 && ok;
+		file = nullptr;
+		return ok;
+	}
+
+private:
+	// Rows y0 to y1 of the image, counted from the bottom
+	struct Band {
+		int y0, y1;
+		std::vector<uint8_t> rows;
+	};
+	struct Compressed {
+		int rows;
+		std::vector<uint8_t> data;
+		uLong adler, length;
+	};
+
+	static void putBE(std::vector<uint8_t>& out, int value)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back((uint8_t)(value >> shift));
+	}
+
+	void chunk(const char* type, const std::vector<uint8_t>& data)
+	{
+		std::vector<uint8_t> head;
+		putBE(head, (int)data.size());
+		head.insert(head.end(), type, type + 4);
+		uLong crc = crc32(0L, Z_NULL, 0);
+		crc = crc32(crc, head.data() + 4, 4);
+		if (!data.empty()) // a null buffer would reset the crc
+			crc = crc32(crc, data.data(), data.size());
+		std::vector<uint8_t> tail;
+		putBE(tail, (int)crc);
+		ok = ok && fwrite(head.data(), 1, head.size(), file) == head.size() &&
+		     fwrite(data.data(), 1, data.size(), file) == data.size() &&
+		     fwrite(tail.data(), 1, tail.size(), file) == tail.size();
+	}
+
+	void work()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;) {
+			wake.wait(guard, [this] { return closing || !queue.empty(); });
+			if (queue.empty())
+				return;
+			Band band = std::move(queue.front());
+			queue.pop_front();
+			guard.unlock();
+			Compressed out = compress(band);
+			guard.lock();
+
+			// PNG rows go from the top, so the band starting at the top of
+			// what's left is the next one out
+			done[height - band.y1] = std::move(out);
+			for (auto next = done.find(nextRow); next != done.end();
+			     next = done.find(nextRow)) {
+				chunk("IDAT", next->second.data);
+				checksum = adler32_combine(checksum, next->second.adler,
+				                           next->second.length);
+				nextRow += next->second.rows;
+				done.erase(next);
+			}
+		}
+	}
+
+	// PNG filter type 0 to 4 (None, Sub, Up, Average, Paeth)
+	static void filter(int type, const uint8_t* row, const uint8_t* above,
+	                   size_t stride, uint8_t* out)
+	{
+		const int bpp = 3;
+		switch (type) {
+		case 0:
+			std::copy(row, row + stride, out);
+			break;
+		case 1:
+			for (size_t i = 0; i < stride; i++)
+				out[i] = row[i] - (i >= bpp ? row[i - bpp] : 0);
+			break;
+		case 2:
+			for (size_t i = 0; i < stride; i++)
+				out[i] = row[i] - above[i];
+			break;
+		case 3:
+			for (size_t i = 0; i < stride; i++)
+				out[i] = row[i] - ((i >= bpp ? row[i - bpp] : 0) + above[i]) / 2;
+			break;
+		case 4:
+			for (size_t i = 0; i < stride; i++) {
+				int a = i >= bpp ? row[i - bpp] : 0;
+				int b = above[i];
+				int c = i >= bpp ? above[i - bpp] : 0;
+				int p = a + b - c;
+				int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+				out[i] = row[i] - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+			}
+			break;
+		}
+	}
+
+	Compressed compress(const Band& band) const
+	{
+		size_t stride = (size_t)width * 3;
+		int rows = band.y1 - band.y0;
+		std::vector<uint8_t> filtered((stride + 1) * rows);
+		std::vector<uint8_t> trial(stride);
+		for (int r = 0; r < rows; r++) {
+			// r counts down the image, rows are stored bottom-up
+			const uint8_t* row = band.rows.data() + (rows - 1 - r) * stride;
+			const uint8_t* above = r > 0 ? row + stride : nullptr;
+			uint8_t* out = filtered.data() + r * (stride + 1);
+
+			// The filter whose output has the smallest sum as signed
+			// bytes, the usual heuristic
+			long best = -1;
+			for (int type = 0; type < (above ? 5 : 2); type++) {
+				filter(type, row, above, stride, trial.data());
+				long sum = 0;
+				for (size_t i = 0; i < stride; i++)
+					sum += abs((int8_t)trial[i]);
+				if (best < 0 || sum < best) {
+					best = sum;
+					out[0] = (uint8_t)type;
+					std::copy(trial.begin(), trial.end(), out + 1);
+				}
+			}
+		}
+
+		Compressed result;
+		result.rows = rows;
+		result.length = filtered.size();
+		result.adler = adler32(adler32(0L, Z_NULL, 0), filtered.data(), filtered.size());
+		z_stream z = {};
+		deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_FILTERED);
+		result.data.resize(deflateBound(&z, filtered.size()) + 16);
+		z.next_in = filtered.data();
+		z.avail_in = filtered.size();
+		z.next_out = result.data.data();
+		z.avail_out = result.data.size();
+		// Only the band at the bottom of the image ends the stream
+		int status = deflate(&z, band.y0 == 0 ? Z_FINISH : Z_SYNC_FLUSH);
+		if (status == Z_STREAM_ERROR || z.avail_in != 0)
+			result.rows = 0; // never goes out, so close() fails
+		result.data.resize(z.total_out);
+		deflateEnd(&z);
+		return result;
+	}
+
+	FILE* file;
+	bool ok;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::vector<std::thread> workers;
+	std::deque<Band> queue;
+	bool closing = false;
+	// Compressed bands waiting for the ones above them, by first PNG row
+	std::map<int, Compressed> done;
+	int nextRow = 0;
+	uLong checksum = adler32(0L, Z_NULL, 0);
+};
+
+}; // Anonymous namespace
+
+ImageWriter* openPNG(const char *fname, int width, int height)
+{
+	FILE* file = fopen(fname, "wb");
+	return file ? new PNGWriter(file, width, height) : nullptr;
+}
+
+void writePNG(const char *fname, int width, int height, const void *data)
+{
+	std::unique_ptr<ImageWriter> out(openPNG(fname, width, height));
+	if (!out)
+		throw string("[write_png_file] File could not be opened for writing: ") + fname;
+	out->writeRows(0, height, (const uint8_t*)data);
+	if (!out->close())
+		throw string("[write_png_file] Error during writing: ") + fname;
+}
+
 /*
- * Copyright 2002-2010 Guillaume Cottenceau.
+ * Based on write_png_file(), copyright 2002-2010 Guillaume Cottenceau.
  *
  * This software may be freely redistributed under the terms
  * of the X11 license.
  *
  */
 
-void writePNG(const char *fname, int width, int height, const void *data)
+namespace {
+void appendToVector(png_structp png_ptr, png_bytep bytes, png_size_t length)
 {
-	constexpr png_byte color_type = PNG_COLOR_TYPE_RGB;
-	constexpr png_byte bit_depth = 8;
-
-	png_structp png_ptr;
-	png_infop info_ptr;
-	int number_of_passes;
-	/* create file */
-	FILE *fp = fopen(fname, "wb");
-	if (!fp)
-		throw string("[write_png_file] File could not be opened for writing: ") + fname;
-
-	/* initialize stuff */
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	auto out = (std::vector<uint8_t>*)png_get_io_ptr(png_ptr);
+	out->insert(out->end(), bytes, bytes + length);
+}
 
-	if (!png_ptr)
-		throw string("[write_png_file] png_create_write_struct failed");
+void flushNothing(png_structp png_ptr)
+{
+}
+};
 
-	info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr)
-		throw string("[write_png_file] png_create_info_struct failed");
+std::vector<uint8_t> encodePNG(int width, int height, const void *data)
+{
+	std::vector<uint8_t> out;
 
-	if (setjmp(png_jmpbuf(png_ptr)))
-		throw string("[write_png_file] Error during init_io");
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr)
+		throw string("[encode_png] png_create_write_struct failed");
 
-	png_init_io(png_ptr, fp);
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr) {
+		png_destroy_write_struct(&png_ptr, NULL);
+		throw string("[encode_png] png_create_info_struct failed");
+	}
 
-	/* write header */
-	if (setjmp(png_jmpbuf(png_ptr)))
-		throw string("[write_png_file] Error during writing header");
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		throw string("[encode_png] Error during encoding");
+	}
 
+	png_set_write_fn(png_ptr, &out, appendToVector, flushNothing);
 	png_set_IHDR(png_ptr, info_ptr, width, height,
-			bit_depth, color_type, PNG_INTERLACE_NONE,
+			8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
 			PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
+	// The buffer is stored bottom-up, like in writePNG
 	std::vector<png_bytep> row_pointers(height);
 	for (int i = 0; i < height; i++)
 		row_pointers[height - i - 1] = (unsigned char*)data + i * width * 3;
 
-#if 1
 	png_set_rows(png_ptr, info_ptr, row_pointers.data());
 	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
-#else
-	png_write_info(png_ptr, info_ptr);
-	/* write bytes */
-	if (setjmp(png_jmpbuf(png_ptr)))
-		abort_("[write_png_file] Error during writing bytes");
-	png_write_image(png_ptr, row_pointers);
-#endif
-
-	/* end write */
-	if (setjmp(png_jmpbuf(png_ptr)))
-		throw string("[write_png_file] Error during end of write");
-
-	png_write_end(png_ptr, NULL);
-
-	fclose(fp);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
+	return out;
 }
@@ -4,9 +4,16 @@
 #include <vector>
 #include <stdint.h>
 
+class ImageWriter;
+
 void png_version_info(void);
 
 std::vector<uint8_t> readPNG(const char *fname, int& width, int& height);
 void writePNG(const char *iname, int width, int height, const void* data); 
+// Streaming, see ImageWriter in images.h.  Bands are compressed in parallel
+// as they arrive, so the file is done soon after the last of them.
+ImageWriter* openPNG(const char *fname, int width, int height);
+// Same as writePNG, into memory instead of a file
+std::vector<uint8_t> encodePNG(int width, int height, const void* data);
 
 #endif
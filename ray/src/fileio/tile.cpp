@@ -0,0 +1,38 @@
+#include "tile.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char TILE_MAGIC[8] = { 'R', 'A', 'Y', 'T', 'I', 'L', 'E', '1' };
+
+bool writeTile(const char *fname, const TileHeader& header,
+               const std::vector<float>& rgb)
+{
+	FILE* file = fopen(fname, "wb");
+	if (!file)
+		return false;
+	bool ok = fwrite(TILE_MAGIC, sizeof(TILE_MAGIC), 1, file) == 1 &&
+	          fwrite(&header, sizeof(header), 1, file) == 1 &&
+	          fwrite(rgb.data(), sizeof(float), rgb.size(), file) == rgb.size();
+	return fclose(file) == 0 && ok;
+}
+
+bool readTile(const char *fname, TileHeader& header, std::vector<float>& rgb)
+{
+	FILE* file = fopen(fname, "rb");
+	if (!file)
+		return false;
+	char magic[sizeof(TILE_MAGIC)];
+	bool ok = fread(magic, sizeof(magic), 1, file) == 1 &&
+	          memcmp(magic, TILE_MAGIC, sizeof(magic)) == 0 &&
+	          fread(&header, sizeof(header), 1, file) == 1 &&
+	          header.x0 >= 0 && header.y0 >= 0 &&
+	          header.x1 <= header.width && header.y1 <= header.height &&
+	          header.x0 < header.x1 && header.y0 < header.y1;
+	if (ok) {
+		rgb.resize((size_t)(header.x1 - header.x0) *
+		           (header.y1 - header.y0) * 3);
+		ok = fread(rgb.data(), sizeof(float), rgb.size(), file) == rgb.size();
+	}
+	fclose(file);
+	return ok;
+}
@@ -0,0 +1,22 @@
+#ifndef FILEIO_TILE_H
+#define FILEIO_TILE_H
+
+#include <vector>
+
+/*
+ * Raw float tiles, written by "ray --region" or "ray --tiles" and assembled
+ * by "ray --merge".  A tile file is a header followed by RGB floats for its
+ * region, rows from top to bottom, all in host byte order.  Coordinates are
+ * pixels from the top left of the full frame; x1 and y1 are exclusive.
+ */
+struct TileHeader {
+	int width, height;  // full frame
+	int x0, y0, x1, y1; // region covered by this tile
+};
+
+extern bool writeTile(const char *fname, const TileHeader& header,
+                      const std::vector<float>& rgb);
+extern bool readTile(const char *fname, TileHeader& header,
+                     std::vector<float>& rgb);
+
+#endif
@@ -4,13 +4,15 @@
 
 #include "RayTracer.h"
 #include "ui/CommandLineUI.h"
+#ifndef _WIN32
+#include "ui/RenderServer.h"
+#include <string.h>
+#endif
 
 using namespace std;
 
 RayTracer* theRayTracer;
-TraceUI* traceUI;
-int TraceUI::m_threads = max(std::thread::hardware_concurrency(), (unsigned)1);
-int TraceUI::rayCount[MAX_THREADS];
+extern TraceUI* traceUI;
 
 // usage : ray [option] in.ray out.bmp
 // Simply keying in ray will invoke a graphics mode version.
@@ -18,8 +20,16 @@ int TraceUI::rayCount[MAX_THREADS];
 //
 // Graphics mode will be substantially slower than text mode because of
 // event handling overhead.
+//
+// "ray --serve [options] socket" keeps running and renders jobs sent over
+// a Unix domain socket; see ui/RenderServer.cpp for the protocol.
 int main(int argc, char** argv)
 {
+#ifndef _WIN32
+	if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+		traceUI = new RenderServer(argc, argv);
+	} else
+#endif
 	if (argc != 1) {
 		// text mode
 		traceUI = new CommandLineUI(argc, argv);
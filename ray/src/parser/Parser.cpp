@@ -54,6 +54,7 @@ Scene* Parser::parseScene()
       case CONE:
       case TORUS:
       case TRIMESH:
+      case INSTANCE:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -167,6 +168,7 @@ void Parser::parseTransformableElement( Scene* scene, TransformNode* transform,
       case TORUS:
       case CONE:
       case TRIMESH:
+      case INSTANCE:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -198,6 +200,7 @@ void Parser::parseGroup(Scene* scene, TransformNode* transform, const Material&
       case TORUS:
       case CONE:
       case TRIMESH:
+      case INSTANCE:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -246,6 +249,9 @@ void Parser::parseGeometry(Scene* scene, TransformNode* transform, const Materia
     case TRIMESH:
       parseTrimesh(scene, transform, mat);
       return;
+    case INSTANCE:
+      parseInstance(scene, transform, mat);
+      return;
     case TRANSLATE:
       parseTranslate(scene, transform, mat);
       return;
@@ -370,6 +376,7 @@ void Parser::parseSphere(Scene* scene, TransformNode* transform, const Material&
 {
   Sphere* sphere = 0;
   Material* newMat = 0;
+  string name;
 
   _tokenizer.Read( SPHERE );
   _tokenizer.Read( LBRACE );
@@ -385,13 +392,14 @@ void Parser::parseSphere(Scene* scene, TransformNode* transform, const Material&
         newMat = parseMaterialExpression( scene, mat );
         break;
       case NAME:
-        parseIdentExpression();
+        name = parseIdentExpression();
         break;
       case RBRACE:
         _tokenizer.Read( RBRACE );
         sphere = new Sphere(scene, newMat ? newMat : new Material(mat));
-        sphere->setTransform( transform );
+        sphere->setTransform( objectTransform( transform, name ) );
         scene->add( sphere );
+        nameObject( scene, name, sphere );
         return;
       default:
         throw SyntaxErrorException( "Expected: sphere attributes", _tokenizer );
@@ -408,6 +416,7 @@ void Parser::parseBox(Scene* scene, TransformNode* transform, const Material& ma
   _tokenizer.Read( LBRACE );
 
   Material* newMat = 0;
+  string name;
   for( ;; )
   {
     const Token* t = _tokenizer.Peek();
@@ -419,13 +428,14 @@ void Parser::parseBox(Scene* scene, TransformNode* transform, const Material& ma
         newMat = parseMaterialExpression( scene, mat );
         break;
       case NAME:
-        parseIdentExpression();
+        name = parseIdentExpression();
         break;
       case RBRACE:
          _tokenizer.Read( RBRACE );
         box = new Box(scene, newMat ? newMat : new Material(mat) );
-        box->setTransform( transform );
+        box->setTransform( objectTransform( transform, name ) );
         scene->add( box );
+        nameObject( scene, name, box );
         return;
       default:
         throw SyntaxErrorException( "Expected: box attributes", _tokenizer );
@@ -438,6 +448,7 @@ void Parser::parseSquare(Scene* scene, TransformNode* transform, const Material&
 {
   Square* square = 0;
   Material* newMat = 0;
+  string name;
 
   _tokenizer.Read( SQUARE );
   _tokenizer.Read( LBRACE );
@@ -453,13 +464,14 @@ void Parser::parseSquare(Scene* scene, TransformNode* transform, const Material&
         newMat = parseMaterialExpression( scene, mat );
         break;
       case NAME:
-        parseIdentExpression();
+        name = parseIdentExpression();
         break;
       case RBRACE:
          _tokenizer.Read( RBRACE );
         square = new Square(scene, newMat ? newMat : new Material(mat));
-        square->setTransform( transform );
+        square->setTransform( objectTransform( transform, name ) );
         scene->add( square );
+        nameObject( scene, name, square );
         return;
       default:
         throw SyntaxErrorException( "Expected: square attributes", _tokenizer );
@@ -472,6 +484,7 @@ void Parser::parseCylinder(Scene* scene, TransformNode* transform, const Materia
 {
   Cylinder* cylinder = 0;
   Material* newMat = 0;
+  string name;
 
   _tokenizer.Read( CYLINDER );
   _tokenizer.Read( LBRACE );
@@ -487,13 +500,14 @@ void Parser::parseCylinder(Scene* scene, TransformNode* transform, const Materia
         newMat = parseMaterialExpression( scene, mat );
         break;
       case NAME:
-        parseIdentExpression();
+        name = parseIdentExpression();
         break;
       case RBRACE:
          _tokenizer.Read( RBRACE );
         cylinder = new Cylinder(scene, newMat ? newMat : new Material(mat));
-        cylinder->setTransform( transform );
+        cylinder->setTransform( objectTransform( transform, name ) );
         scene->add( cylinder );
+        nameObject( scene, name, cylinder );
         return;
       default:
         throw SyntaxErrorException( "Expected: cylinder attributes", _tokenizer );
@@ -506,6 +520,7 @@ void Parser::parseTorus(Scene* scene, TransformNode* transform, const Material&
 {
   Torus* torus = 0;
   Material* newMat = 0;
+  string name;
 
   _tokenizer.Read( TORUS );
   _tokenizer.Read( LBRACE );
@@ -524,7 +539,7 @@ void Parser::parseTorus(Scene* scene, TransformNode* transform, const Material&
         newMat = parseMaterialExpression( scene, mat );
         break;
       case NAME:
-        parseIdentExpression();
+        name = parseIdentExpression();
         break;
       case INNER_RADIUS:
         inner_r = parseScalarExpression();
@@ -535,8 +550,9 @@ void Parser::parseTorus(Scene* scene, TransformNode* transform, const Material&
       case RBRACE:
          _tokenizer.Read( RBRACE );
         torus= new Torus(scene, newMat ? newMat : new Material(mat), inner_r, outer_r);
-        torus->setTransform( transform );
+        torus->setTransform( objectTransform( transform, name ) );
         scene->add( torus );
+        nameObject( scene, name, torus );
         return;
       default:
         throw SyntaxErrorException( "Expected: torus attributes", _tokenizer );
@@ -552,6 +568,7 @@ void Parser::parseCone(Scene* scene, TransformNode* transform, const Material& m
 
   Cone* cone;
   Material* newMat = 0;
+  string name;
 
   double bottomRadius = 1.0;
   double topRadius = 0.0;
@@ -569,7 +586,7 @@ void Parser::parseCone(Scene* scene, TransformNode* transform, const Material& m
         newMat = parseMaterialExpression( scene, mat );
         break;
       case NAME:
-         parseIdentExpression();
+         name = parseIdentExpression();
          break;
       case CAPPED:
         capped = parseBooleanExpression();
@@ -587,8 +604,9 @@ void Parser::parseCone(Scene* scene, TransformNode* transform, const Material& m
         _tokenizer.Read( RBRACE );
         cone = new Cone( scene, newMat ? newMat : new Material(mat), 
           height, bottomRadius, topRadius, capped );
-        cone->setTransform( transform );
+        cone->setTransform( objectTransform( transform, name ) );
         scene->add( cone );
+        nameObject( scene, name, cone );
         return;
       default:
         throw SyntaxErrorException( "Expected: cone attributes", _tokenizer );
@@ -605,6 +623,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
 
   bool generateNormals( false );
   list<glm::dvec3> faces;
+  string name;
 
   const char* error;
   for( ;; )
@@ -624,7 +643,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case NAME:
-         parseIdentExpression();
+         name = parseIdentExpression();
          break;
 
       case MATERIALS:
@@ -713,6 +732,10 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
       {
         _tokenizer.Read( RBRACE );
 
+        // Named meshes can be animated, so they get a transform node of
+        // their own; the faces share it with the mesh.
+        tmesh->setTransform( objectTransform( transform, name ) );
+
         // Now add all the faces into the trimesh, since hopefully
         // the vertices have been parsed out
         for( list<glm::dvec3>::const_iterator vitr = faces.begin(); vitr != faces.end(); vitr++ )
@@ -734,6 +757,10 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
           throw ParserException(error);
 
         scene->add( tmesh );
+        nameObject( scene, name, tmesh );
+
+        if( ! name.empty() )
+          meshes[ name ] = tmesh;
         return;
       }
 
@@ -743,6 +770,76 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   }
 }
 
+// An instance places a previously named trimesh under the current
+// transform without copying its geometry:
+//
+//   trimesh { name = "tree"; points = ...; faces = ...; }
+//   translate( 4, 0, 0, instance { name = "tree"; } )
+//
+// The prototype's material is used unless the instance sets its own.
+void Parser::parseInstance(Scene* scene, TransformNode* transform, const Material& mat)
+{
+  _tokenizer.Read( INSTANCE );
+  _tokenizer.Read( LBRACE );
+
+  string name;
+  Material* newMat = 0;
+
+  for( ;; )
+  {
+    const Token* t = _tokenizer.Peek();
+
+    switch( t->kind() )
+    {
+      case MATERIAL:
+        delete newMat;
+        newMat = parseMaterialExpression( scene, mat );
+        break;
+      case NAME:
+        name = parseIdentExpression();
+        break;
+      case RBRACE:
+      {
+        _tokenizer.Read( RBRACE );
+        std::map<string, Trimesh*>::const_iterator itr = meshes.find( name );
+        if( itr == meshes.end() )
+        {
+          delete newMat;
+          ostringstream oss;
+          oss << "Instance of undefined trimesh '" << name << "'.";
+          throw SyntaxErrorException( oss.str(), _tokenizer );
+        }
+        scene->add( new TrimeshInstance( scene, newMat, itr->second, transform ) );
+        return;
+      }
+      default:
+        throw SyntaxErrorException( "Expected: instance attributes", _tokenizer );
+    }
+  }
+}
+
+// Objects with a name can be moved by an animation, so they get a transform
+// node of their own instead of sharing the one they were parsed under with
+// their siblings.
+TransformNode* Parser::objectTransform( TransformNode* transform, const string& name )
+{
+  if( name.empty() )
+    return transform;
+  return transform->createChild( glm::dmat4x4( 1.0 ) );
+}
+
+void Parser::nameObject( Scene* scene, const string& name, Geometry* obj )
+{
+  if( name.empty() )
+    return;
+  if( !scene->nameObject( name, obj ) )
+  {
+    ostringstream oss;
+    oss << "Redefinition of object '" << name << "'.";
+    throw SyntaxErrorException( oss.str(), _tokenizer );
+  }
+}
+
 void Parser::parseFaces( list< glm::dvec3 >& faces )
 {
   list< double > points = parseScalarList();
@@ -73,8 +73,13 @@ private:
     void      parseTorus(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseCone(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseTrimesh(Scene* scene, TransformNode* transform, const Material& mat);
+    void      parseInstance(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseFaces( std::list< glm::dvec3 >& faces );
 
+    // Transform node and scene registration for objects with a name
+    TransformNode* objectTransform( TransformNode* transform, const string& name );
+    void nameObject( Scene* scene, const string& name, Geometry* obj );
+
     // Parse transforms
     void parseTranslate(Scene* scene, TransformNode* transform, const Material& mat);
     void parseRotate(Scene* scene, TransformNode* transform, const Material& mat);
@@ -107,6 +112,7 @@ private:
   private:
     Tokenizer& _tokenizer;
     mmap materials;
+    std::map<string, Trimesh*> meshes;  // named trimeshes available to 'instance'
     std::string _basePath;
 };
 
@@ -90,6 +90,7 @@ string getNameForToken( const SYMBOL kind )
     tokenNames[ INDEX ]             = "index";
     tokenNames[ NAME ]              = "name";
     tokenNames[ MAP ]               = "map";
+    tokenNames[ INSTANCE ]          = "instance";
   }
   // search tokenNames table
   std::map<int, string>::const_iterator itr = 
@@ -142,6 +143,7 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["height"] = HEIGHT;
     reservedWords["index"] = INDEX;
     reservedWords["inner_radius"] = INNER_RADIUS;
+    reservedWords["instance"] = INSTANCE;
     reservedWords["linear_attenuation_coeff"] = LINEAR_ATTENUATION_COEFF;
     reservedWords["material"] = MATERIAL;
     reservedWords["materials"] = MATERIALS;
@@ -84,7 +84,9 @@ enum SYMBOL {
   DIFFUSE, TRANSMISSIVE,
   SHININESS, INDEX,
   NAME,
-  MAP
+  MAP,
+
+  INSTANCE					// placement of a named trimesh
 };
 
 // Helper functions
@@ -0,0 +1,132 @@
+#include "profile.h"
+
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ui/json.hpp"
+
+using namespace std;
+using Json = nlohmann::json;
+
+bool Profiler::on = false;
+
+namespace {
+
+struct Event {
+	const char* name;
+	const char* category;
+	long long begin; // ns since enable()
+	long long length;
+	int tile;
+	string detail;
+};
+
+// Spans recorded by one thread.  Only that thread appends to it.
+struct ThreadLog {
+	string name;
+	vector<Event> events;
+};
+
+Profiler::clock::time_point epoch;
+mutex logsLock;
+vector<unique_ptr<ThreadLog>> logs;
+thread_local ThreadLog* threadLog = nullptr;
+
+ThreadLog* currentLog()
+{
+	if (!threadLog) {
+		lock_guard<mutex> guard(logsLock);
+		logs.emplace_back(new ThreadLog);
+		threadLog = logs.back().get();
+		threadLog->name = "thread " + to_string(logs.size());
+	}
+	return threadLog;
+}
+
+long long sinceEpoch(Profiler::clock::time_point t)
+{
+	return chrono::duration_cast<chrono::nanoseconds>(t - epoch).count();
+}
+
+} // anonymous namespace
+
+void Profiler::enable()
+{
+	if (on)
+		return;
+	epoch = clock::now();
+	on = true;
+}
+
+void Profiler::nameThread(const string& name)
+{
+	if (!on)
+		return;
+	ThreadLog* log = currentLog();
+	lock_guard<mutex> guard(logsLock);
+	log->name = name;
+}
+
+void Profiler::span(const char* name, const char* category,
+                    clock::time_point begin, clock::time_point end, int tile,
+                    const string& detail)
+{
+	long long b = sinceEpoch(begin);
+	currentLog()->events.push_back(
+	        Event{ name, category, b, sinceEpoch(end) - b, tile, detail });
+}
+
+double Profiler::total(const char* name)
+{
+	lock_guard<mutex> guard(logsLock);
+	long long ns = 0;
+	for (const auto& log : logs)
+		for (const auto& e : log->events)
+			if (string(e.name) == name)
+				ns += e.length;
+	return ns * 1e-9;
+}
+
+bool Profiler::write(const string& file)
+{
+	lock_guard<mutex> guard(logsLock);
+
+	// Threads with the same name share a row
+	map<string, int> tids;
+	for (const auto& log : logs) {
+		int next = tids.size() + 1;
+		if (!tids.count(log->name))
+			tids[log->name] = next;
+	}
+
+	Json events = Json::array();
+	events.push_back({ { "name", "process_name" }, { "ph", "M" },
+	                   { "pid", 1 }, { "args", { { "name", "ray" } } } });
+	for (const auto& tid : tids)
+		events.push_back({ { "name", "thread_name" }, { "ph", "M" },
+		                   { "pid", 1 }, { "tid", tid.second },
+		                   { "args", { { "name", tid.first } } } });
+	for (const auto& log : logs) {
+		int tid = tids[log->name];
+		for (const auto& e : log->events) {
+			// Timestamps are in microseconds
+			Json event = { { "name", e.name }, { "cat", e.category },
+			               { "ph", "X" }, { "pid", 1 }, { "tid", tid },
+			               { "ts", e.begin / 1000.0 },
+			               { "dur", e.length / 1000.0 } };
+			if (e.tile >= 0)
+				event["args"]["tile"] = e.tile;
+			if (!e.detail.empty())
+				event["args"]["detail"] = e.detail;
+			events.push_back(event);
+		}
+	}
+
+	ofstream ofs(file);
+	ofs << Json{ { "traceEvents", events }, { "displayTimeUnit", "ms" } }.dump()
+	    << endl;
+	return bool(ofs);
+}
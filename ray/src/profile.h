@@ -0,0 +1,76 @@
+#pragma once
+
+// Wall-clock spans of what the tracer spends its time on, written out in
+// the Chrome trace format that chrome://tracing and Perfetto load.
+//
+// Recording is off until Profiler::enable(); a disabled ProfileScope
+// costs one flag test.  Each thread appends to its own buffer, so worker
+// threads never wait on each other to record a span.
+
+#include <chrono>
+#include <string>
+
+class Profiler {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	static void enable();
+	static bool enabled() { return on; }
+
+	// Rows in the trace viewer are per name, so a worker that is
+	// recreated for every pass stays on one row.
+	static void nameThread(const std::string& name);
+
+	// Record a span that ran from begin to end on this thread.  Names and
+	// categories must be string literals (they are kept by pointer).  A
+	// tile index >= 0 and a non-empty detail (e.g. a file name) are
+	// attached as arguments.
+	static void span(const char* name, const char* category,
+	                 clock::time_point begin, clock::time_point end,
+	                 int tile = -1, const std::string& detail = "");
+
+	// Write everything recorded so far.  Returns false if the file can't
+	// be written.
+	static bool write(const std::string& file);
+
+	// Total seconds recorded under name, over all threads.  Only call
+	// this once the threads doing the recording are done.
+	static double total(const char* name);
+
+private:
+	static bool on;
+};
+
+// Records the time from construction to destruction as a span
+class ProfileScope {
+public:
+	ProfileScope(const char* name, const char* category = "phase",
+	             int tile = -1)
+	        : name(name), category(category), tile(tile)
+	{
+		if (Profiler::enabled())
+			begin = Profiler::clock::now();
+	}
+	ProfileScope(const char* name, const char* category,
+	             const std::string& detail)
+	        : name(name), category(category), tile(-1)
+	{
+		if (Profiler::enabled()) {
+			this->detail = detail;
+			begin = Profiler::clock::now();
+		}
+	}
+	~ProfileScope()
+	{
+		if (Profiler::enabled())
+			Profiler::span(name, category, begin,
+			               Profiler::clock::now(), tile, detail);
+	}
+
+private:
+	const char* name;
+	const char* category;
+	int tile;
+	std::string detail;
+	Profiler::clock::time_point begin;
+};
@@ -0,0 +1,61 @@
+//
+// animation.h
+//
+// Per-frame changes to a loaded scene, used to render sequences without
+// reparsing the scene file for every frame.
+//
+
+#ifndef __ANIMATION_H__
+#define __ANIMATION_H__
+
+#include <string>
+#include <vector>
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+
+// Changes to one named object.  The transform replaces the object's own
+// local transform (the one below everything it inherits from the scene
+// file), and points replace the vertices of a trimesh, in their original
+// order.
+struct ObjectUpdate {
+	std::string name;
+	bool hasTransform = false;
+	glm::dmat4x4 transform = glm::dmat4x4(1.0);
+	std::vector<glm::dvec3> points;
+};
+
+// Camera changes.  A look-at point overrides the view direction and is
+// taken relative to the (possibly updated) eye position.
+struct CameraUpdate {
+	bool hasPosition = false;
+	bool hasViewDir = false;
+	bool hasUpDir = false;
+	bool hasLookAt = false;
+	bool hasFov = false;
+	glm::dvec3 position;
+	glm::dvec3 viewDir;
+	glm::dvec3 upDir;
+	glm::dvec3 lookAt;
+	double fov = 0.0;
+};
+
+// Changes to one light, identified by its position in the scene file.
+// Position only applies to point lights and direction to directional ones.
+struct LightUpdate {
+	int index = 0;
+	bool hasColor = false;
+	bool hasPosition = false;
+	bool hasDirection = false;
+	glm::dvec3 color;
+	glm::dvec3 position;
+	glm::dvec3 direction;
+};
+
+struct FrameUpdate {
+	CameraUpdate camera;
+	std::vector<LightUpdate> lights;
+	std::vector<ObjectUpdate> objects;
+};
+
+#endif // __ANIMATION_H__
@@ -20,6 +20,7 @@ public:
 
 	const glm::dvec3& getEye() const			{ return eye; }
 	const glm::dvec3& getLook() const		{ return look; }
+	glm::dvec3 getUpDir() const			{ return m[1]; }
 	const glm::dvec3& getU() const			{ return u; }
 	const glm::dvec3& getV() const			{ return v; }
 private:
@@ -1,13 +1,14 @@
 #include "cubeMap.h"
 #include "ray.h"
 #include "material.h"
+#include <algorithm>
 #include <iostream>
 #include "../ui/TraceUI.h"
 #include "../scene/material.h"
 extern TraceUI* traceUI;
 extern bool debugMode;
 
-glm::dvec3 CubeMap::getColor(ray r) const
+glm::dvec3 CubeMap::getColor(const ray& r) const
 {
 	// YOUR CODE HERE
 	// FIXME: Implement Cube Map here
@@ -49,8 +50,13 @@ glm::dvec3 CubeMap::getColor(ray r) const
 		cout << "face: " << face << " u: " << u << " v: " << v << endl;
 	}
 
+	// u and v move about one unit per radian the direction turns, so the
+	// cone's spread is already a width in uv
+	double footprint = std::max(traceUI->getFilterWidth() / double(tMap[face]->getWidth()),
+	                            r.getSpread());
+
 	// auto color =  tMap[face]->getMappedValue(glm::dvec2(abs(u), abs(v)));
-	auto color = tMap[face]->getMappedValue(glm::dvec2(u + .5, v + .5));
+	auto color = tMap[face]->getMappedValue(glm::dvec2(u + .5, v + .5), footprint);
 	return color;
 }
 
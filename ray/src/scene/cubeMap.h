@@ -33,6 +33,9 @@ public:
 
 	void setNthMap(int n, TextureMap* m);
 
-	glm::dvec3 getColor(ray r) const;
+	// Each face keeps the mip levels TextureMap builds as it loads, so a
+	// blurred lookup is one (trilinear) fetch: blurred over filter_width
+	// texels, or the ray's cone where that is wider.
+	glm::dvec3 getColor(const ray& r) const;
 
 };
@@ -9,7 +9,6 @@ using std::max;
 
 #include "scene.h"
 #include "../ui/TraceUI.h"
-#include <FL/gl.h>
 
 class Light
 	: public SceneElement
@@ -20,6 +19,7 @@ public:
 	virtual glm::dvec3 getColor() const = 0;
 	virtual glm::dvec3 getDirection (const glm::dvec3& P) const = 0;
 
+	void setColor(const glm::dvec3& col) { color = col; }
 
 protected:
 	Light(Scene *scene, const glm::dvec3& col) : SceneElement(scene), color(col) {}
@@ -27,7 +27,9 @@ protected:
 	glm::dvec3 color;
 
 public:
-	virtual void glDraw(GLenum lightID) const { }
+	// lightID is a GLenum (GL_LIGHT0...); the GL headers are only needed
+	// by the viewer that draws lights, not by the tracer.
+	virtual void glDraw(unsigned int lightID) const { }
 	virtual void glDraw() const { }
 };
 
@@ -42,11 +44,13 @@ public:
 	virtual glm::dvec3 getColor() const;
 	virtual glm::dvec3 getDirection(const glm::dvec3& P) const;
 
+	void setOrientation(const glm::dvec3& orien) { orientation = glm::normalize(orien); }
+
 protected:
 	glm::dvec3 		orientation;
 
 public:
-	void glDraw(GLenum lightID) const;
+	void glDraw(unsigned int lightID) const;
 	void glDraw() const;
 };
 
@@ -68,6 +72,8 @@ public:
 	virtual glm::dvec3 getColor() const;
 	virtual glm::dvec3 getDirection(const glm::dvec3& P) const;
 
+	void setPosition(const glm::dvec3& pos) { position = pos; }
+
 	void setAttenuationConstants(float a, float b, float c)
 	{
 		constantTerm = a;
@@ -87,7 +93,7 @@ protected:
 	float quadraticTerm;	// c
 
 public:
-	void glDraw(GLenum lightID) const;
+	void glDraw(unsigned int lightID) const;
 	void glDraw() const;
 
 protected:
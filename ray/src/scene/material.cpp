@@ -9,7 +9,12 @@ extern TraceUI* traceUI;
 #include <glm/gtx/io.hpp>
 #include <iostream>
 #include <algorithm>
+#include <string.h>
+#include <sys/stat.h>
 #include "../fileio/images.h"
+#include "../fileio/mapped.h"
+#include "../profile.h"
+#include "textureCache.h"
 
 using namespace std;
 extern bool debugMode;
@@ -98,21 +103,329 @@ glm::dvec3 Material::shade(Scene* scene, const ray& r, const isect& i) const
 	return result;
 }
 
-TextureMap::TextureMap(string filename)
+static const int TEXTURE_TILE_BITS = 5;
+static const int TEXTURE_TILE = 1 << TEXTURE_TILE_BITS;
+static const size_t TEXTURE_TILE_BYTES = 3 * TEXTURE_TILE * TEXTURE_TILE;
+
+static std::atomic<unsigned long long> nextTextureId(1);
+
+TextureMap::TextureMap(string filename, TextureCache* cache, bool keepDecoded)
+	: filename(filename), cache(cache), keepDecoded(keepDecoded),
+	  id(nextTextureId++), ready(false), width(0), height(0)
 {
-	data = readImage(filename.c_str(), width, height);
-	if (data.empty()) {
-		width = 0;
-		height = 0;
+	if (!cache) {
+		decode();
+		return;
+	}
+	// Fail while parsing, as an eagerly loaded texture would
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (!f) {
 		string error("Unable to load texture map '");
 		error.append(filename);
 		error.append("'.");
 		throw TextureMapException(error);
 	}
+	fclose(f);
+}
+
+TextureMap::~TextureMap()
+{
+	if (cache)
+		cache->forget(this);
+	if (scratch)
+		fclose(scratch);
+}
+
+void TextureMap::decode() const
+{
+	std::lock_guard<std::mutex> guard(decoding);
+	if (ready.load(std::memory_order_relaxed))
+		return;
+
+	ProfileScope span("texture load", "phase", filename);
+	if (keepDecoded && mapDecoded()) {
+		ready.store(true, std::memory_order_release);
+		return;
+	}
+	std::unique_lock<std::mutex> one;
+	if (cache)
+		one = std::unique_lock<std::mutex>(cache->loadLock());
+	int w, h;
+	std::vector<uint8_t> image = readImage(filename.c_str(), w, h);
+	if (image.empty()) {
+		string error("Unable to load texture map '");
+		error.append(filename);
+		error.append("'.");
+		if (!cache)
+			throw TextureMapException(error);
+		// Too late to stop the render; carry on with black
+		cerr << error << endl;
+		w = h = 1;
+		image.assign(3, 0);
+	}
+	width = w;
+	height = h;
+	buildLevels(image);
+	if (keepDecoded)
+		saveDecoded();
+	if (cache) {
+		if (cache->getBudget())
+			page();
+		cache->loaded();
+	}
+	ready.store(true, std::memory_order_release);
+}
+
+// Spread the low 8 bits of v out to the even bits
+static inline int spreadBits(int v)
+{
+	v = (v | (v << 4)) & 0x0f0f;
+	v = (v | (v << 2)) & 0x3333;
+	v = (v | (v << 1)) & 0x5555;
+	return v;
+}
+
+// Byte offset of texel (x, y) of a level tilesX tiles across
+static inline size_t tiledIndex(int tilesX, int x, int y)
+{
+	size_t tile = (size_t)(y >> TEXTURE_TILE_BITS) * tilesX + (x >> TEXTURE_TILE_BITS);
+	int inTile = spreadBits(x & (TEXTURE_TILE - 1)) |
+	             spreadBits(y & (TEXTURE_TILE - 1)) << 1;
+	return tile * TEXTURE_TILE_BYTES + 3 * inTile;
+}
+
+// Tile the image into level 0, then halve it down to a single texel,
+// each texel of a level averaging (up to) four of the one above.
+void TextureMap::buildLevels(const std::vector<uint8_t>& image) const
+{
+	levels.clear();
+	int w = width, h = height;
+	for (;;) {
+		Level level;
+		level.width = w;
+		level.height = h;
+		level.tilesX = (w + TEXTURE_TILE - 1) / TEXTURE_TILE;
+		level.offset = 0;
+		int tilesY = (h + TEXTURE_TILE - 1) / TEXTURE_TILE;
+		level.texels.resize(TEXTURE_TILE_BYTES * level.tilesX * tilesY);
+
+		for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++) {
+				uint8_t* out = &level.texels[tiledIndex(level.tilesX, x, y)];
+				if (levels.empty()) {
+					const uint8_t* in = &image[3 * ((size_t)y * w + x)];
+					out[0] = in[0];
+					out[1] = in[1];
+					out[2] = in[2];
+					continue;
+				}
+				const Level& above = levels.back();
+				int x1 = std::min(2 * x + 1, above.width - 1);
+				int y1 = std::min(2 * y + 1, above.height - 1);
+				const uint8_t* t[4] = {
+					&above.texels[tiledIndex(above.tilesX, 2 * x, 2 * y)],
+					&above.texels[tiledIndex(above.tilesX, x1, 2 * y)],
+					&above.texels[tiledIndex(above.tilesX, 2 * x, y1)],
+					&above.texels[tiledIndex(above.tilesX, x1, y1)] };
+				for (int c = 0; c < 3; c++)
+					out[c] = (t[0][c] + t[1][c] + t[2][c] + t[3][c] + 2) / 4;
+			}
+		levels.push_back(std::move(level));
+		levels.back().data = levels.back().texels.data();
+		if (w == 1 && h == 1)
+			break;
+		w = std::max(w / 2, 1);
+		h = std::max(h / 2, 1);
+	}
+}
+
+// Move every level out to a scratch file for the cache to read back.
+// If that fails the texture just stays in memory.
+void TextureMap::page() const
+{
+	scratch = tmpfile();
+	if (!scratch)
+		return;
+	long offset = 0;
+	for (auto& level : levels) {
+		if (fwrite(level.texels.data(), 1, level.texels.size(), scratch) !=
+		    level.texels.size()) {
+			fclose(scratch);
+			scratch = nullptr;
+			return;
+		}
+		level.offset = offset;
+		offset += level.texels.size();
+	}
+	for (auto& level : levels) {
+		std::vector<uint8_t>().swap(level.texels);
+		level.data = nullptr;
+	}
+}
+
+// Decoded textures (filename.mip) are, in host byte order: a MipHeader,
+// a MipLevel for each level, then the levels' tiles as laid out in memory,
+// each level starting on a 64-byte boundary.
+static const char MIP_MAGIC[8] = { 'R', 'A', 'Y', 'M', 'I', 'P', '0', '1' };
+
+struct MipHeader {
+	char magic[8];
+	// Of the image it was decoded from
+	long long sourceSize, sourceTime;
+	int width, height, levels, tileBits;
+};
+
+struct MipLevel {
+	int width, height, tilesX, unused;
+	long long offset, bytes;
+};
+
+static bool sourceStamp(const string& filename, long long& size, long long& time)
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+	size = st.st_size;
+	time = st.st_mtime;
+	return true;
+}
+
+// Map the decoded copy if there is an up to date one
+bool TextureMap::mapDecoded() const
+{
+	MipHeader header;
+	long long size, time;
+	std::unique_ptr<MappedFile> file(new MappedFile);
+	if (!sourceStamp(filename, size, time) ||
+	    !file->open((filename + ".mip").c_str()) ||
+	    file->size() < sizeof(header))
+		return false;
+	memcpy(&header, file->data(), sizeof(header));
+	if (memcmp(header.magic, MIP_MAGIC, sizeof(MIP_MAGIC)) != 0 ||
+	    header.sourceSize != size || header.sourceTime != time ||
+	    header.tileBits != TEXTURE_TILE_BITS || header.levels < 1 ||
+	    file->size() < sizeof(header) + header.levels * sizeof(MipLevel))
+		return false;
+
+	std::vector<Level> mapped(header.levels);
+	for (int l = 0; l < header.levels; l++) {
+		MipLevel m;
+		memcpy(&m, file->data() + sizeof(header) + l * sizeof(MipLevel), sizeof(m));
+		int tilesY = (m.height + TEXTURE_TILE - 1) / TEXTURE_TILE;
+		if (m.width < 1 || m.height < 1 ||
+		    m.tilesX != (m.width + TEXTURE_TILE - 1) / TEXTURE_TILE ||
+		    m.bytes != (long long)(TEXTURE_TILE_BYTES * m.tilesX * tilesY) ||
+		    m.offset < 0 || (unsigned long long)(m.offset + m.bytes) > file->size())
+			return false;
+		mapped[l].width = m.width;
+		mapped[l].height = m.height;
+		mapped[l].tilesX = m.tilesX;
+		mapped[l].data = file->data() + m.offset;
+		mapped[l].offset = 0;
+	}
+	width = header.width;
+	height = header.height;
+	levels = std::move(mapped);
+	decoded = std::move(file);
+	return true;
+}
+
+// Save the levels for mapDecoded().  Written under another name and moved
+// into place, so a concurrent load never sees half a file.  It's only a
+// cache, so failing to write it (e.g. a read-only directory) is fine.
+void TextureMap::saveDecoded() const
+{
+	MipHeader header;
+	memcpy(header.magic, MIP_MAGIC, sizeof(MIP_MAGIC));
+	if (!sourceStamp(filename, header.sourceSize, header.sourceTime))
+		return;
+	header.width = width;
+	header.height = height;
+	header.levels = levels.size();
+	header.tileBits = TEXTURE_TILE_BITS;
+
+	std::vector<MipLevel> table(levels.size());
+	long long offset = sizeof(header) + table.size() * sizeof(MipLevel);
+	for (size_t l = 0; l < levels.size(); l++) {
+		offset = (offset + 63) & ~63LL;
+		table[l] = MipLevel{ levels[l].width, levels[l].height,
+		                     levels[l].tilesX, 0, offset,
+		                     (long long)levels[l].texels.size() };
+		offset += table[l].bytes;
+	}
+
+	string name = filename + ".mip";
+	string temp = name + ".tmp";
+	FILE* file = fopen(temp.c_str(), "wb");
+	if (!file)
+		return;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+	          fwrite(table.data(), sizeof(MipLevel), table.size(), file) == table.size();
+	for (size_t l = 0; ok && l < levels.size(); l++) {
+		static const char zeros[64] = {};
+		long pad = table[l].offset - ftell(file);
+		ok = fwrite(zeros, 1, pad, file) == (size_t)pad &&
+		     fwrite(levels[l].texels.data(), 1, levels[l].texels.size(), file) ==
+		             levels[l].texels.size();
+	}
+	ok = fclose(file) == 0 && ok;
+	if (ok) {
+		remove(name.c_str());
+		ok = rename(temp.c_str(), name.c_str()) == 0;
+	}
+	if (!ok)
+		remove(temp.c_str());
+}
+
+void TextureMap::readTile(int level, int tile, std::vector<uint8_t>& out) const
+{
+	out.resize(TEXTURE_TILE_BYTES);
+	std::lock_guard<std::mutex> guard(scratchLock);
+	if (fseek(scratch, levels[level].offset + (long)(tile * TEXTURE_TILE_BYTES), SEEK_SET) ||
+	    fread(out.data(), 1, out.size(), scratch) != out.size())
+		std::fill(out.begin(), out.end(), 0);
+}
+
+// The last few tiles each thread read from the cache.  A texture's id is
+// never reused, so entries of a deleted texture can't be mistaken for
+// another's.
+namespace {
+struct RecentTile {
+	unsigned long long texture = 0;
+	int level, tile;
+	std::shared_ptr<const TextureCache::Tile> texels;
+};
+const int RECENT_TILES = 64;
+thread_local RecentTile recentTiles[RECENT_TILES];
+}
+
+glm::dvec3 TextureMap::texel(int l, int x, int y) const
+{
+	const Level& level = levels[l];
+	x = std::min(std::max(x, 0), level.width - 1);
+	y = std::min(std::max(y, 0), level.height - 1);
+	size_t index = tiledIndex(level.tilesX, x, y);
+	const uint8_t* rgb;
+	if (level.data) {
+		rgb = level.data + index;
+	} else {
+		int tile = index / TEXTURE_TILE_BYTES;
+		RecentTile& recent = recentTiles[(tile * 31 + l * 7 + id) % RECENT_TILES];
+		if (recent.texture != id || recent.level != l || recent.tile != tile) {
+			recent.texels = cache->fetch(this, l, tile);
+			recent.texture = id;
+			recent.level = l;
+			recent.tile = tile;
+		}
+		rgb = recent.texels->data() + index % TEXTURE_TILE_BYTES;
+	}
+	return glm::dvec3(rgb[0], rgb[1], rgb[2]);
 }
 
 glm::dvec3 TextureMap::getMappedValue(const glm::dvec2& coord) const
 {
+	load();
+
 	// YOUR CODE HERE
 	//
 	// In order to add texture mapping support to the
@@ -158,26 +471,57 @@ glm::dvec3 TextureMap::getMappedValue(const glm::dvec2& coord) const
 	return ret; 
 }
 
-glm::dvec3 TextureMap::getPixelAt(int x, int y) const
+glm::dvec3 TextureMap::getMappedValue(const glm::dvec2& coord, double footprint) const
 {
-	// YOUR CODE HERE
-	//
-	// In order to add texture mapping support to the
-	// raytracer, you need to implement this function.
+	if (footprint <= 0.0)
+		return getMappedValue(coord);
+	load();
+	// Sampled the same way at every level, even the finest, so the texture
+	// doesn't shift as the footprint grows past a texel
+	double lod = std::log2(footprint * std::max(width, height));
+	if (lod <= 0.0)
+		return bilinear(0, coord);
 
-	//bitmap.cpp: Data is (R,G,B) in row-major order
-	auto pos = 3*y*width + 3*x;
-	auto red = data[pos];
-	auto green = data[pos + 1];
-	auto blue = data[pos + 2];
+	lod = std::min(lod, double(levels.size() - 1));
+	int fine = int(lod);
+	double blend = lod - fine;
+	glm::dvec3 ret = bilinear(fine, coord);
+	if (blend > 0.0)
+		ret = (1 - blend) * ret + blend * bilinear(fine + 1, coord);
+	return ret;
+}
 
-	return glm::dvec3(red, green, blue)/(256.0);
+// Texel centres sit at half-integer coordinates; edges clamp
+glm::dvec3 TextureMap::bilinear(int l, const glm::dvec2& coord) const
+{
+	double u = coord[0] * levels[l].width - 0.5;
+	double v = coord[1] * levels[l].height - 0.5;
+	int x = (int)std::floor(u);
+	int y = (int)std::floor(v);
+	double fu = u - x;
+	double fv = v - y;
+
+	glm::dvec3 top = (1 - fu) * texel(l, x, y) + fu * texel(l, x + 1, y);
+	glm::dvec3 bottom = (1 - fu) * texel(l, x, y + 1) + fu * texel(l, x + 1, y + 1);
+	return ((1 - fv) * top + fv * bottom) / 256.0;
+}
+
+glm::dvec3 TextureMap::getPixelAt(int x, int y) const
+{
+	return getPixelAt(x, y, 0);
+}
+
+glm::dvec3 TextureMap::getPixelAt(int x, int y, int level) const
+{
+	load();
+	return texel(level, x, y)/(256.0);
 }
 
 glm::dvec3 MaterialParameter::value(const isect& is) const
 {
 	if (0 != _textureMap)
-		return _textureMap->getMappedValue(is.getUVCoordinates());
+		return _textureMap->getMappedValue(is.getUVCoordinates(),
+		                                   is.getUVFootprint());
 	else
 		return _value;
 }
@@ -185,8 +529,8 @@ glm::dvec3 MaterialParameter::value(const isect& is) const
 double MaterialParameter::intensityValue(const isect& is) const
 {
 	if (0 != _textureMap) {
-		glm::dvec3 value(
-		        _textureMap->getMappedValue(is.getUVCoordinates()));
+		glm::dvec3 value(_textureMap->getMappedValue(
+		        is.getUVCoordinates(), is.getUVFootprint()));
 		return (0.299 * value[0]) + (0.587 * value[1]) +
 		       (0.114 * value[2]);
 	} else
@@ -10,11 +10,17 @@
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 #include <glm/glm.hpp>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
 #include <string>
 #include <vector>
 #include <stdint.h>
 
 class Scene;
+class TextureCache;
+class MappedFile;
 class ray;
 class isect;
 
@@ -28,7 +34,13 @@ using std::string;
 */
 class TextureMap {
     public:
-       TextureMap( string filename );
+       // With a cache the image is only checked for now, and decoded
+       // the first time it's looked up (see TextureCache).  With
+       // keepDecoded, the decoded levels are saved next to the image (as
+       // filename.mip) and later loads map that file instead of decoding,
+       // as long as the image hasn't changed.
+       TextureMap( string filename, TextureCache* cache = nullptr,
+                   bool keepDecoded = false );
 
        // Return the mapped value; here the coordinate
        // is assumed to be within the parametrization space:
@@ -36,20 +48,68 @@ class TextureMap {
        // (i.e., {(u, v): 0 <= u <= 1 and 0 <= v <= 1}
        glm::dvec3 getMappedValue( const glm::dvec2& coord ) const;
 
+       // The same, filtered over a footprint this wide in uv units:
+       // blends the two mip levels whose texels are nearest that size.
+       // Footprints under a texel use the full-size bilinear lookup above.
+       glm::dvec3 getMappedValue( const glm::dvec2& coord, double footprint ) const;
+
        // Retrieve the value stored in a physical location
        // (with integer coordinates) in the bitmap.
        // Should be called from getMappedValue in order to
        // do bilinear interpolation.
        glm::dvec3 getPixelAt( int x, int y ) const;
+       glm::dvec3 getPixelAt( int x, int y, int level ) const;
+
+	   int getWidth() const { load(); return width; }
+	   int getHeight() const { load(); return height; }
+	   int getLevels() const { load(); return levels.size(); }
 
-	   int getWidth() const { return width; }
-	   int getHeight() const { return height; }
+	   // Unique for the life of the program
+	   unsigned long long getId() const { return id; }
+	   // Copy tile of level, as laid out below, from the scratch file
+	   void readTile( int level, int tile, std::vector<uint8_t>& out ) const;
 
-	  ~TextureMap() { }
+	  ~TextureMap();
 protected:
-       int width;
-       int height;
-       std::vector<uint8_t> data;
+       // One level of the mip pyramid.  Texels are stored in 32x32
+       // tiles, row by row, each tile in Morton order, so a lookup and
+       // its neighbours usually share a cache line or two.  A tile is
+       // also what TextureCache pages in and out.
+       struct Level {
+           int width, height;
+           int tilesX;
+           std::vector<uint8_t> texels; // RGB, when decoded here
+           const uint8_t* data;         // texels or a mapped file; null when paged
+           long offset;                 // in the scratch file
+       };
+
+       void load() const
+       {
+           if (!ready.load(std::memory_order_acquire))
+               decode();
+       }
+       void decode() const;
+       void buildLevels( const std::vector<uint8_t>& image ) const;
+       void page() const;
+       bool mapDecoded() const;
+       void saveDecoded() const;
+       glm::dvec3 texel( int level, int x, int y ) const;
+       glm::dvec3 bilinear( int level, const glm::dvec2& coord ) const;
+
+       string filename;
+       TextureCache* cache;
+       bool keepDecoded;
+       unsigned long long id;
+
+       // Filled in by decode()
+       mutable std::atomic<bool> ready;
+       mutable std::mutex decoding;
+       mutable int width;
+       mutable int height;
+       mutable std::vector<Level> levels;
+       mutable FILE* scratch = nullptr;
+       mutable std::unique_ptr<MappedFile> decoded;
+       mutable std::mutex scratchLock;
 };
 
 class TextureMapException {
@@ -18,7 +18,9 @@ ray::ray(const glm::dvec3& pp,
 	TraceUI::addRay(ray_thread_id);
 }
 
-ray::ray(const ray& other) : p(other.p), d(other.d), atten(other.atten)
+ray::ray(const ray& other)
+        : p(other.p), d(other.d), atten(other.atten),
+          coneWidth(other.coneWidth), coneSpread(other.coneSpread)
 {
 	TraceUI::addRay(ray_thread_id);
 }
@@ -33,6 +35,8 @@ ray& ray::operator=(const ray& other)
 	d     = other.d;
 	atten = other.atten;
 	t     = other.t;
+	coneWidth  = other.coneWidth;
+	coneSpread = other.coneSpread;
 	return *this;
 }
 
@@ -48,11 +48,24 @@ public:
 	void setPosition(const glm::dvec3& pp) { p = pp; }
 	void setDirection(const glm::dvec3& dd) { d = dd; }
 
+	// The cone of space the ray stands for, used to pick how much texture
+	// detail a hit can show: it is width across at the origin and widens
+	// by spread per unit of distance.  Zero spread means a thin ray.
+	void setCone(double width, double spread)
+	{
+		coneWidth = width;
+		coneSpread = spread;
+	}
+	double getSpread() const { return coneSpread; }
+	double footprint(double t) const { return coneWidth + coneSpread * t; }
+
 private:
 	glm::dvec3 p;
 	glm::dvec3 d;
 	glm::dvec3 atten;
 	RayType t;
+	double coneWidth = 0.0;
+	double coneSpread = 0.0;
 };
 
 
@@ -75,6 +88,7 @@ public:
 	}
 
 	void setObject(const SceneObject* o) { obj = o; }
+	const SceneObject* getObject() const { return obj; }
 
 	// Get/Set Time of flight
 	void setT(double tt) { t = tt; }
@@ -95,6 +109,13 @@ public:
 		uvCoordinates = coords;
 	}
 	glm::dvec2 getUVCoordinates() const { return uvCoordinates; }
+	// Width of the ray's footprint in uv units, 0 if unknown
+	void setUVFootprint(double w) { uvFootprint = w; }
+	double getUVFootprint() const { return uvFootprint; }
+	// Index of the hit object among the scene's objects, -1 if unknown.
+	// Faces of a mesh share the mesh's.
+	void setObjectId(int id) { objectId = id; }
+	int getObjectId() const { return objectId; }
 	void setBary(const glm::dvec3& weights) { bary = weights; }
 	void setBary(const double alpha, const double beta, const double gamma)
 	{
@@ -112,6 +133,8 @@ private:
 		N             = other.N;
 		bary          = other.bary;
 		uvCoordinates = other.uvCoordinates;
+		uvFootprint   = other.uvFootprint;
+		objectId      = other.objectId;
 		if (other.material) {
 			setMaterial(*other.material);
 		} else {
@@ -123,6 +146,8 @@ private:
 	double t;
 	glm::dvec3 N;
 	glm::dvec2 uvCoordinates;
+	double uvFootprint = 0.0;
+	int objectId = -1;
 	glm::dvec3 bary;
 
 	// if this intersection has its own material
@@ -0,0 +1,123 @@
+#include "rayLog.h"
+#include "../ui/TraceUI.h"
+
+#include <algorithm>
+
+static thread_local int pixelX = -1;
+static thread_local int pixelY = -1;
+// Workers have rings 0 to MAX_THREADS - 1; everyone else shares the last.
+// ray_thread_id can't pick it: it is 0 for the UI thread and worker 0 alike.
+static thread_local unsigned int ringIndex = MAX_THREADS;
+
+static const int RINGS = MAX_THREADS + 1;
+
+RayLog::RayLog() : rings(new std::atomic<Ring*>[RINGS])
+{
+	for (int i = 0; i < RINGS; i++)
+		rings[i] = nullptr;
+}
+
+RayLog::~RayLog()
+{
+	for (int i = 0; i < RINGS; i++)
+		delete rings[i].load();
+}
+
+void RayLog::setPixel(int x, int y)
+{
+	pixelX = x;
+	pixelY = y;
+}
+
+void RayLog::setWorker(unsigned int id)
+{
+	ringIndex = id % MAX_THREADS;
+}
+
+void RayLog::setRegion(int x0, int y0, int x1, int y1)
+{
+	hasRegion = true;
+	regionX0 = x0;
+	regionY0 = y0;
+	regionX1 = x1;
+	regionY1 = y1;
+}
+
+bool RayLog::wanted(ray::RayType type, int x, int y) const
+{
+	if (!(types & (1u << type)))
+		return false;
+	if (x < 0)
+		return true;
+	if (x % stride || y % stride)
+		return false;
+	return !hasRegion || (x >= regionX0 && x < regionX1 && y >= regionY0 &&
+	                      y < regionY1);
+}
+
+void RayLog::record(const ray& r, const isect& i, bool hit)
+{
+	if (!wanted(r.type(), pixelX, pixelY))
+		return;
+
+	// A thread's ring is only allocated once it has something to log
+	std::atomic<Ring*>& slot = rings[ringIndex];
+	Ring* ring = slot.load(std::memory_order_acquire);
+	if (!ring) {
+		Ring* fresh = new Ring;
+		if (slot.compare_exchange_strong(ring, fresh))
+			ring = fresh;
+		else
+			delete fresh;
+	}
+
+	unsigned long long n = ring->written.load(std::memory_order_relaxed);
+	RayRecord& rec = ring->records[n % CAPACITY];
+	glm::dvec3 p = r.getPosition();
+	glm::dvec3 d = r.getDirection();
+	glm::dvec3 N = i.getN();
+	for (int k = 0; k < 3; k++) {
+		rec.origin[k] = float(p[k]);
+		rec.direction[k] = float(d[k]);
+		rec.normal[k] = float(N[k]);
+	}
+	rec.t = float(i.getT());
+	rec.x = pixelX;
+	rec.y = pixelY;
+	rec.type = (unsigned char)r.type();
+	rec.hit = hit;
+	ring->written.store(n + 1, std::memory_order_release);
+}
+
+void RayLog::clear()
+{
+	for (int i = 0; i < RINGS; i++)
+		if (Ring* ring = rings[i].load(std::memory_order_acquire))
+			ring->written.store(0, std::memory_order_release);
+}
+
+std::vector<RayRecord> RayLog::snapshot() const
+{
+	std::vector<RayRecord> out;
+	for (int i = 0; i < RINGS; i++) {
+		Ring* ring = rings[i].load(std::memory_order_acquire);
+		if (!ring)
+			continue;
+		unsigned long long end = ring->written.load(std::memory_order_acquire);
+		unsigned long long begin = end > CAPACITY ? end - CAPACITY : 0;
+		size_t base = out.size();
+		for (unsigned long long n = begin; n < end; n++)
+			out.push_back(ring->records[n % CAPACITY]);
+
+		// The owner kept writing while we copied; drop anything it may
+		// have overwritten under us.  That includes record now - CAPACITY,
+		// whose slot record now may be half written into.
+		unsigned long long now = ring->written.load(std::memory_order_acquire);
+		if (now >= end && now - begin >= CAPACITY) {
+			size_t stale = std::min<unsigned long long>(now - begin - CAPACITY + 1,
+			                                            end - begin);
+			out.erase(out.begin() + base, out.begin() + base + stale);
+		}
+	}
+	return out;
+}
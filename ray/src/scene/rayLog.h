@@ -0,0 +1,81 @@
+//
+// rayLog.h
+//
+// What the debugging view draws: the rays the tracer intersected with the
+// scene, kept as small fixed-size records.
+//
+
+#ifndef __RAYLOG_H__
+#define __RAYLOG_H__
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "ray.h"
+
+// One intersection test.  Plain data, so logging it never allocates.
+struct RayRecord {
+	float origin[3];
+	float direction[3];
+	float normal[3];
+	float t;      // distance to the hit, or 1000 on a miss
+	int x, y;     // pixel being traced, -1 if none
+	unsigned char type; // ray::RayType
+	bool hit;
+};
+
+// Each render worker logs into its own ring of CAPACITY records, and any
+// other thread (the UI tracing a single debugging ray) into one more, so
+// recording takes no locks and memory stays bounded:
+// once a ring is full the oldest records are overwritten.  snapshot()
+// merges the rings for drawing.
+//
+// To keep a full render from flooding the rings, records can be limited
+// to every Nth pixel across and down, to a pixel region and to some ray
+// types.  Rays traced outside any pixel (e.g. a single debugging ray)
+// always pass the pixel filters.
+class RayLog {
+public:
+	static const size_t CAPACITY = 1 << 14;
+
+	RayLog();
+	~RayLog();
+
+	// Called for every intersection test while debugging
+	void record(const ray& r, const isect& i, bool hit);
+
+	// Forget everything recorded.  Not safe while threads are recording.
+	void clear();
+
+	// Everything still in the rings, each thread's records oldest first
+	std::vector<RayRecord> snapshot() const;
+
+	// Pixel the calling thread is tracing; records are tagged with it
+	static void setPixel(int x, int y);
+	// Called by render worker id (< MAX_THREADS) before it traces
+	static void setWorker(unsigned int id);
+
+	void setStride(int n) { stride = n < 1 ? 1 : n; }
+	void setRegion(int x0, int y0, int x1, int y1);
+	void clearRegion() { hasRegion = false; }
+	// Bit (1 << ray::RayType) set for each type to keep
+	void setTypes(unsigned mask) { types = mask; }
+
+private:
+	struct Ring {
+		std::atomic<unsigned long long> written{ 0 };
+		RayRecord records[CAPACITY];
+	};
+
+	bool wanted(ray::RayType type, int x, int y) const;
+
+	std::unique_ptr<std::atomic<Ring*>[]> rings;
+
+	int stride = 1;
+	bool hasRegion = false;
+	int regionX0, regionY0, regionX1, regionY1;
+	unsigned types = ~0u;
+};
+
+#endif // __RAYLOG_H__
@@ -3,12 +3,14 @@
 #include "scene.h"
 #include "light.h"
 #include "kdTree.h"
+#include "../SceneObjects/trimesh.h"
 #include "../ui/TraceUI.h"
 #include <glm/gtx/extended_min_max.hpp>
 #include <iostream>
 #include <glm/gtx/io.hpp>
 
 using namespace std;
+extern TraceUI* traceUI;
 
 bool Geometry::intersect(ray& r, isect& i) const {
 	double tmin, tmax;
@@ -37,6 +39,19 @@ bool Geometry::intersect(ray& r, isect& i) const {
 	return rtrn;
 }
 
+// Primitives lay uv out over their unit-sized local shape, so the width
+// of the ray's footprint in uv is its width on the surface (the cone
+// stretched by how obliquely the ray meets it) in local units.  A local
+// patch with world normal N is |M^T N| / |det M| times the area of its
+// world image, M being the object's transform.
+double Geometry::uvFootprint(const ray& r, const isect& i) const {
+	glm::dvec3 N = i.getN();
+	double cosine = std::max(std::abs(glm::dot(glm::normalize(r.getDirection()), N)), 0.01);
+	glm::dmat3x3 M(transform->transform());
+	double areaScale = glm::length(glm::transpose(M) * N) / std::abs(glm::determinant(M));
+	return r.footprint(i.getT()) / cosine * std::sqrt(areaScale);
+}
+
 bool Geometry::hasBoundingBoxCapability() const {
 	// by default, primitives do not have to specify a bounding box.
 	// If this method returns true for a primitive, then either the ComputeBoundingBox() or
@@ -90,12 +105,14 @@ void Geometry::ComputeBoundingBox() {
 }
 
 Scene::Scene()
+	: root(nullptr), buildCost(0.0)
 {
 	ambientIntensity = glm::dvec3(0, 0, 0);
 }
 
 Scene::~Scene()
 {
+	deleteBVH(root);
 }
 
 void Scene::add(Geometry* obj) {
@@ -116,10 +133,14 @@ bool Scene::intersect(ray& r, isect& i) const {
 	double tmin = 0.0;
 	double tmax = 0.0;
 	bool have_one = false;
+	int hitObject = 0;
 	vector<BVH*> s;
-	s.push_back(root);
+	if(root != nullptr)
+		s.push_back(root);
+	int visited = 0;
 	while(!s.empty()) {
 		BVH* curr = s[s.size() - 1];
+		visited++;
 		s.pop_back();
 		// cout << "curr: " << curr << endl;
 		// cout << "curr.left : " << curr->left << endl;
@@ -130,6 +151,8 @@ bool Scene::intersect(ray& r, isect& i) const {
 				if(objects[curr->index]->intersect(r, cur)){
 					if(!have_one || (cur.getT() < i.getT())){
 						i = cur;
+						i.setObjectId(curr->index);
+						hitObject = curr->index;
 						have_one = true;
 					}
 				}
@@ -151,13 +174,16 @@ bool Scene::intersect(ray& r, isect& i) const {
 	// 		}
 	// 	}
 	// }
+	TraceUI::addNodeVisits(visited, ray_thread_id);
 	if(!have_one)
 		i.setT(1000.0);
+	else if (r.getSpread() > 0.0)
+		// The transform is the one of the object in the scene, which for
+		// an instance isn't that of the prototype face it reports
+		i.setUVFootprint(objects[hitObject]->uvFootprint(r, i));
 	// if debugging,
 	if (TraceUI::m_debug)
-	{
-		addToIntersectCache(std::make_pair(new ray(r), new isect(i)));
-	}
+		rayLog.record(r, i, have_one);
 	return have_one;
 }
 
@@ -222,6 +248,8 @@ BVH* Scene::recursiveBuild(unordered_map<int, glm::dvec3> map, glm::dvec3 axes)
 }
 
 void Scene::Init(){
+	boundedObj.clear();
+	nonboundedObj.clear();
 	for( int i = 0; i < objects.size(); i++ ) {
 		if( (objects[i])->hasBoundingBoxCapability() ){
 			boundedObj.push_back(i);
@@ -230,18 +258,152 @@ void Scene::Init(){
 			nonboundedObj.push_back(i);
 		}
 	}
+	buildBVH();
+}
+
+void Scene::buildBVH(){
+	deleteBVH(root);
+	root = nullptr;
 	unordered_map<int, glm::dvec3> data;
 	for(int i = 0; i < boundedObj.size(); i ++) {
 		data.emplace(boundedObj[i], objects[boundedObj[i]]->getBoundingBox().getCentroid());
 	}
-	glm::dvec3 axes = findLongestAxis(data);
-	root = recursiveBuild(data, axes);
+	if(!data.empty()) {
+		glm::dvec3 axes = findLongestAxis(data);
+		root = recursiveBuild(data, axes);
+	}
+	buildCost = sahCost(root);
+}
+
+bool Scene::updateAccelerators(){
+	sceneBounds = BoundingBox();
+	for(auto& obj : objects) {
+		obj->ComputeBoundingBox();
+		sceneBounds.merge(obj->getBoundingBox());
+	}
+	refitBVH(root, [this](int i) { return objects[i]->getBoundingBox(); });
+	if(sahCost(root) > buildCost * traceUI->getRebuildThreshold()) {
+		buildBVH();
+		return true;
+	}
+	return false;
+}
+
+bool Scene::nameObject(const string& name, Geometry* obj){
+	return namedObjects.emplace(name, obj).second;
+}
+
+Geometry* Scene::findObject(const string& name) const{
+	auto itr = namedObjects.find(name);
+	return itr == namedObjects.end() ? nullptr : itr->second;
+}
+
+string Scene::applyFrame(const FrameUpdate& frame, bool* moved){
+	// Check everything before touching the scene so that a bad frame
+	// leaves it as it was.
+	for(const auto& update : frame.lights) {
+		if(update.index < 0 || (size_t)update.index >= lights.size())
+			return "No light number " + to_string(update.index);
+		Light* light = lights[update.index].get();
+		if(update.hasPosition && dynamic_cast<PointLight*>(light) == nullptr)
+			return "Light " + to_string(update.index) + " is not a point light";
+		if(update.hasDirection && dynamic_cast<DirectionalLight*>(light) == nullptr)
+			return "Light " + to_string(update.index) + " is not a directional light";
+	}
+	for(const auto& update : frame.objects) {
+		Geometry* obj = findObject(update.name);
+		if(obj == nullptr)
+			return "No object named '" + update.name + "'";
+		if(update.points.empty())
+			continue;
+		Trimesh* mesh = dynamic_cast<Trimesh*>(obj);
+		if(mesh == nullptr)
+			return "Object '" + update.name + "' is not a trimesh";
+		if(update.points.size() != mesh->numVertices())
+			return "Wrong number of points for trimesh '" + update.name + "'";
+	}
+
+	// Camera::setLook() takes its basis as given, so the view and up
+	// directions are made unit length and perpendicular here
+	const CameraUpdate& cam = frame.camera;
+	bool newLook = cam.hasViewDir || cam.hasUpDir || cam.hasLookAt;
+	glm::dvec3 viewDir = camera.getLook(), upDir = camera.getUpDir();
+	if(newLook) {
+		glm::dvec3 eye = cam.hasPosition ? cam.position : camera.getEye();
+		if(cam.hasLookAt)
+			viewDir = cam.lookAt - eye;
+		else if(cam.hasViewDir)
+			viewDir = cam.viewDir;
+		if(cam.hasUpDir)
+			upDir = cam.upDir;
+		if(glm::length(viewDir) < RAY_EPSILON)
+			return "Camera view direction is zero";
+		viewDir = glm::normalize(viewDir);
+		if(glm::length(upDir) < RAY_EPSILON)
+			return "Camera up direction is zero";
+		glm::dvec3 right = glm::cross(viewDir, glm::normalize(upDir));
+		if(glm::length(right) < RAY_EPSILON)
+			return "Camera up direction is parallel to the view direction";
+		right = glm::normalize(right);
+		upDir = glm::cross(right, viewDir);
+	}
+
+	// Keys are applied to every frame of their track, so most updates put
+	// things where they already are; only real changes count as moves.
+	bool objectsMoved = false;
+	for(const auto& update : frame.objects) {
+		Geometry* obj = findObject(update.name);
+		if(update.hasTransform &&
+		   update.transform != obj->getTransform()->localTransform()) {
+			obj->getTransform()->setLocalTransform(update.transform);
+			objectsMoved = true;
+		}
+		if(!update.points.empty()) {
+			Trimesh* mesh = static_cast<Trimesh*>(obj);
+			if(update.points != mesh->getVertices()) {
+				mesh->setVertices(update.points);
+				objectsMoved = true;
+			}
+		}
+	}
+	for(const auto& update : frame.lights) {
+		Light* light = lights[update.index].get();
+		if(update.hasColor)
+			light->setColor(update.color);
+		if(update.hasPosition)
+			static_cast<PointLight*>(light)->setPosition(update.position);
+		if(update.hasDirection)
+			static_cast<DirectionalLight*>(light)->setOrientation(update.direction);
+	}
+
+	Camera before = camera;
+	if(cam.hasPosition)
+		camera.setEye(cam.position);
+	if(newLook)
+		camera.setLook(viewDir, upDir);
+	if(cam.hasFov)
+		camera.setFOV(cam.fov);
+
+	// Rebuilding the same view may differ in the last bits
+	auto near = [](const glm::dvec3& a, const glm::dvec3& b) {
+		return glm::length(a - b) <= 1e-12 * (1.0 + glm::length(a));
+	};
+	bool cameraMoved = !near(before.getEye(), camera.getEye()) ||
+	                   !near(before.getLook(), camera.getLook()) ||
+	                   !near(before.getU(), camera.getU()) ||
+	                   !near(before.getV(), camera.getV());
+
+	if(objectsMoved)
+		updateAccelerators();
+	if(moved)
+		*moved = objectsMoved || cameraMoved;
+	return "";
 }
 
 TextureMap* Scene::getTexture(string name) {
 	auto itr = textureCache.find(name);
 	if (itr == textureCache.end()) {
-		textureCache[name].reset(new TextureMap(name));
+		textureCache[name].reset(new TextureMap(name, &texturePages));
 		return textureCache[name].get();
 	}
 	return itr->second.get();
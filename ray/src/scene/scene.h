@@ -20,6 +20,9 @@
 #include "camera.h"
 #include "material.h"
 #include "ray.h"
+#include "rayLog.h"
+#include "textureCache.h"
+#include "animation.h"
 #include "../bvh.h"
 
 #include <unordered_map>
@@ -67,6 +70,7 @@ inline glm::dvec3 operator*(const glm::dmat4x4& mat, const glm::dvec3& vec)
 class TransformNode {
 protected:
 	// information about this node's transformation
+	glm::dmat4x4 local;
 	glm::dmat4x4 xform;
 	glm::dmat4x4 inverse;
 	glm::dmat3x3 normi;
@@ -114,21 +118,39 @@ public:
 	}
 
 	const glm::dmat4x4& transform() const { return xform; }
+	const glm::dmat4x4& localTransform() const { return local; }
+
+	// Replace this node's transformation relative to its parent.  The
+	// world transforms of the whole subtree are recomputed, but bounding
+	// boxes of the objects hanging off it are not; see
+	// Scene::updateAccelerators().
+	void setLocalTransform(const glm::dmat4x4& xform)
+	{
+		local = xform;
+		update();
+	}
 
 protected:
 	// protected so that users can't directly construct one of these...
 	// force them to use the createChild() method.  Note that they CAN
 	// directly create a TransformRoot object.
 	TransformNode(TransformNode* parent, const glm::dmat4x4& xform)
-	        : children()
+	        : local(xform), children()
 	{
 		this->parent = parent;
+		update();
+	}
+
+	void update()
+	{
 		if (parent == NULL)
-			this->xform = xform;
+			xform = local;
 		else
-			this->xform = parent->xform * xform;
-		inverse = glm::inverse(this->xform);
-		normi = glm::transpose(glm::inverse(glm::dmat3x3(this->xform)));
+			xform = parent->xform * local;
+		inverse = glm::inverse(xform);
+		normi = glm::transpose(glm::inverse(glm::dmat3x3(xform)));
+		for (auto c : children)
+			c->update();
 	}
 };
 
@@ -150,6 +172,9 @@ public:
 	// intersections performed in the global coordinate space.
 	bool intersect(ray& r, isect& i) const;
 
+	// How wide the cone of r is in uv units where it hit this object at i
+	double uvFootprint(const ray& r, const isect& i) const;
+
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
 	glm::dvec3 getNormal() { return glm::dvec3(1.0, 0.0, 0.0); }
@@ -165,6 +190,7 @@ public:
 	{
 		this->transform = transform;
 	};
+	TransformNode* getTransform() const { return transform; }
 
 	Geometry(Scene* scene) : SceneElement(scene) {}
 
@@ -234,6 +260,25 @@ public:
 	void add(Light* light);
 	void Init();
 
+	// Objects given a name in the scene file, so that an animation can
+	// refer to them.  nameObject() returns false if the name is taken.
+	bool nameObject(const string& name, Geometry* obj);
+	Geometry* findObject(const string& name) const;
+
+	// Move named objects to where the given frame puts them and bring the
+	// acceleration structures up to date.  Returns an error message, or an
+	// empty string on success.  *moved is set if the camera or any object
+	// actually ended up somewhere else, as opposed to only lights changing.
+	string applyFrame(const FrameUpdate& frame, bool* moved = nullptr);
+
+	// Recompute object bounds after transforms or vertices have changed and
+	// refit the BVH to them.  The tree is rebuilt from scratch instead if
+	// refitting has degraded its SAH cost past the rebuild threshold.
+	// Returns true if it was rebuilt.
+	bool updateAccelerators();
+	double bvhCost() const { return sahCost(root); }
+	BVH* getBVH() const { return root; }
+
 	bool intersect(ray& r, isect& i) const;
 	BVH* recursiveBuild(unordered_map<int, glm::dvec3> map, glm::dvec3 axes);
 	auto beginLights() const { return lights.begin(); }
@@ -249,8 +294,11 @@ public:
 
 	// For efficiency reasons, we'll store texture maps in a cache
 	// in the Scene.  This makes sure they get deleted when the scene
-	// is destroyed.
+	// is destroyed.  Their texels are only loaded once they're looked
+	// up, and held within the texture cache's budget.
 	TextureMap* getTexture(string name);
+	TextureCache& getTextureCache() { return texturePages; }
+	const TextureCache& getTextureCache() const { return texturePages; }
 
 	// These two functions are for handling ambient light; in the Phong
 	// model,
@@ -275,12 +323,18 @@ private:
 	std::vector<int> nonboundedObj;
 	std::vector<int> boundedObj;
 	BVH* root;
+	double buildCost; // SAH cost of the tree when it was last built
+	std::map<string, Geometry*> namedObjects;
 	Camera camera;
 
+	void buildBVH();
+
 	// This is the total amount of ambient light in the scene
 	// (used as the I_a in the Phong shading model)
 	glm::dvec3 ambientIntensity;
 
+	// Declared first so the textures are gone before it is
+	TextureCache texturePages;
 	typedef std::map<std::string, std::unique_ptr<TextureMap>> tmap;
 	tmap textureCache;
 
@@ -293,25 +347,11 @@ private:
 
 	KdTree<Geometry>* kdtree;
 
-	mutable std::mutex intersectionCacheMutex;
+	// Intersections logged while debugging
+	mutable RayLog rayLog;
 
 public:
-	// This is used for debugging purposes only.
-	void addToIntersectCache(std::pair<ray*, isect*> isect) const
-	{
-		intersectionCacheMutex.lock();
-		intersectCache.push_back(isect);
-		intersectionCacheMutex.unlock();
-	}
-
-	void clearIntersectCache() const
-	{
-		intersectionCacheMutex.lock();
-		intersectCache.clear();
-		intersectionCacheMutex.unlock();
-	}
-
-	mutable std::vector<std::pair<ray*, isect*>> intersectCache;
+	RayLog& getRayLog() const { return rayLog; }
 };
 
 #endif // __SCENE_H__
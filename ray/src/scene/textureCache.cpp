@@ -0,0 +1,84 @@
+#include "textureCache.h"
+#include "material.h"
+
+#include <algorithm>
+
+void TextureCache::setBudget(size_t bytes)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	budget = bytes;
+	if (budget)
+		shrink(budget);
+}
+
+TextureCache::Stats TextureCache::stats() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return counters;
+}
+
+std::shared_ptr<const TextureCache::Tile> TextureCache::fetch(const TextureMap* tex, int level, int tile)
+{
+	Key key{ tex->getId(), level, tile };
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = tiles.find(key);
+		if (found != tiles.end()) {
+			lru.splice(lru.begin(), lru, found->second.age);
+			counters.hits++;
+			return found->second.tile;
+		}
+		counters.misses++;
+	}
+
+	// Read outside the lock; another thread may fetch the same tile
+	// meanwhile, in which case its copy wins.
+	std::shared_ptr<Tile> read = std::make_shared<Tile>();
+	tex->readTile(level, tile, *read);
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto found = tiles.find(key);
+	if (found != tiles.end())
+		return found->second.tile;
+	lru.push_front(key);
+	tiles[key] = Entry{ read, lru.begin() };
+	counters.bytes += read->size();
+	counters.peakBytes = std::max(counters.peakBytes, counters.bytes);
+	if (budget)
+		shrink(budget);
+	return read;
+}
+
+// Drop least recently used tiles until at most limit bytes are held
+void TextureCache::shrink(size_t limit)
+{
+	while (counters.bytes > limit && !lru.empty()) {
+		auto oldest = tiles.find(lru.back());
+		counters.bytes -= oldest->second.tile->size();
+		counters.evictions++;
+		tiles.erase(oldest);
+		lru.pop_back();
+	}
+}
+
+void TextureCache::forget(const TextureMap* tex)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	unsigned long long id = tex->getId();
+	for (auto age = lru.begin(); age != lru.end();) {
+		if (age->texture == id) {
+			auto entry = tiles.find(*age);
+			counters.bytes -= entry->second.tile->size();
+			tiles.erase(entry);
+			age = lru.erase(age);
+		} else {
+			++age;
+		}
+	}
+}
+
+void TextureCache::loaded()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	counters.loads++;
+}
@@ -0,0 +1,85 @@
+//
+// textureCache.h
+//
+// Keeps the texels of a scene's textures in memory within a byte budget,
+// a tile at a time.
+//
+
+#ifndef __TEXTURECACHE_H__
+#define __TEXTURECACHE_H__
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+class TextureMap;
+
+// With a budget set, a texture is decoded the first time it's looked up,
+// written out as tiles to a scratch file, and from then on read back a
+// tile at a time.  Tiles stay cached until the bytes held exceed the
+// budget, when the least recently used ones are dropped.  Without a
+// budget (the default) textures simply stay whole in memory once loaded.
+//
+// A tile handed out stays valid for as long as its holder keeps the
+// pointer, even if the cache drops it meanwhile.
+class TextureCache {
+public:
+	typedef std::vector<uint8_t> Tile;
+
+	struct Stats {
+		long long hits = 0;      // tile requests served from memory
+		long long misses = 0;    // ... and read back from scratch files
+		long long evictions = 0;
+		int loads = 0;           // textures decoded
+		size_t bytes = 0;        // held in tiles right now
+		size_t peakBytes = 0;
+	};
+
+	// 0 for no limit.  Only textures loaded after this is set are paged.
+	void setBudget(size_t bytes);
+	size_t getBudget() const { return budget; }
+
+	Stats stats() const;
+
+	// For TextureMap
+	std::shared_ptr<const Tile> fetch(const TextureMap* tex, int level, int tile);
+	void forget(const TextureMap* tex);
+	void loaded();
+	// Held while decoding, so at most one full-size image is in memory
+	std::mutex& loadLock() { return decoding; }
+
+private:
+	struct Key {
+		unsigned long long texture;
+		int level, tile;
+		bool operator==(const Key& o) const
+		{
+			return texture == o.texture && level == o.level && tile == o.tile;
+		}
+	};
+	struct KeyHash {
+		size_t operator()(const Key& k) const
+		{
+			return std::hash<unsigned long long>()(k.texture * 1000003u +
+			                                       k.level * 7919u + k.tile);
+		}
+	};
+	struct Entry {
+		std::shared_ptr<const Tile> tile;
+		std::list<Key>::iterator age;
+	};
+
+	void shrink(size_t limit);
+
+	size_t budget = 0;
+	mutable std::mutex lock;
+	std::mutex decoding;
+	std::list<Key> lru; // most recently used first
+	std::unordered_map<Key, Entry, KeyHash> tiles;
+	Stats counters;
+};
+
+#endif // __TEXTURECACHE_H__
@@ -1,6 +1,13 @@
+#include <signal.h>
 #include <stdarg.h>
-#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
 #include <iostream>
+#include <thread>
+#include <vector>
 #ifndef _MSC_VER
 #include <unistd.h>
 #else
@@ -12,12 +19,64 @@ extern int getopt(int argc, char** argv, const char* optstring);
 #include <assert.h>
 
 #include "../fileio/images.h"
+#include "../fileio/pfm.h"
+#include "../fileio/tile.h"
 #include "CommandLineUI.h"
 
 #include "../RayTracer.h"
+#include "../SceneObjects/trimesh.h"
+#include "../bvh.h"
+#include "../profile.h"
 
 using namespace std;
 
+// Output name for one frame of an animation: a pattern with one "%d" or
+// "%0Nd" (and "%%" for a literal percent sign), such as "out%03d.png", has
+// the frame number put in its place, otherwise the number goes in front of
+// the extension.  The pattern is never handed to printf.  Returns false if
+// it has any other kind of '%'.
+static bool frameFileName(const string& pattern, int frame, string& name)
+{
+	name.clear();
+	bool numbered = false;
+	for (size_t i = 0; i < pattern.size(); i++) {
+		if (pattern[i] != '%') {
+			name += pattern[i];
+			continue;
+		}
+		if (i + 1 < pattern.size() && pattern[i + 1] == '%') {
+			name += '%';
+			i++;
+			continue;
+		}
+		size_t end = i + 1;
+		while (end < pattern.size() && isdigit((unsigned char)pattern[end]))
+			end++;
+		size_t digits = end - (i + 1);
+		if (numbered || end >= pattern.size() || pattern[end] != 'd' ||
+		    (digits > 0 && pattern[i + 1] != '0') || digits > 3)
+			return false;
+		string number = std::to_string(frame);
+		int width = digits > 0 ? atoi(pattern.substr(i + 1, digits).c_str()) : 0;
+		if ((int)number.size() < width)
+			number.insert(0, width - number.size(), '0');
+		name += number;
+		numbered = true;
+		i = end;
+	}
+	if (numbered)
+		return true;
+
+	size_t dot = name.find_last_of('.');
+	size_t slash = name.find_last_of("\\/");
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		dot = name.size();
+	char buf[16];
+	snprintf(buf, sizeof(buf), ".%04d", frame);
+	name = name.substr(0, dot) + buf + name.substr(dot);
+	return true;
+}
+
 // The command line UI simply parses out all the arguments off
 // the command line and stores them locally.
 CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
@@ -25,8 +84,77 @@ CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
 	int i;
 	progName = argv[0];
 	const char* jsonfile = nullptr;
+	const char* animfile = nullptr;
 	string cubemap_file;
-	while ((i = getopt(argc, argv, "tr:w:hj:c:")) != EOF) {
+
+	// Long options are picked out by hand, since getopt_long() isn't
+	// available everywhere (see win32/getopt.cpp).
+	int kept = 1;
+	for (int a = 1; a < argc; a++) {
+		string arg = argv[a];
+		bool hasValue = a + 1 < argc;
+		if (arg == "--merge") {
+			mergeMode = true;
+		} else if (arg == "--bvh-stats") {
+			bvhStatsMode = true;
+		} else if (arg == "--region" && hasValue) {
+			if (sscanf(argv[++a], "%d,%d,%d,%d", &regionX0, &regionY0,
+			           &regionX1, &regionY1) != 4 ||
+			    regionX0 < 0 || regionY0 < 0 || regionX1 <= regionX0 ||
+			    regionY1 <= regionY0) {
+				std::cerr << "Bad region '" << argv[a]
+				          << "', expected x0,y0,x1,y1." << std::endl;
+				exit(1);
+			}
+			hasRegion = true;
+		} else if (arg == "--tiles" && hasValue) {
+			tileCount = atoi(argv[++a]);
+		} else if (arg == "--tile-index" && hasValue) {
+			tileIndex = atoi(argv[++a]);
+		} else if (arg == "--checkpoint" && hasValue) {
+			checkpointFile = argv[++a];
+		} else if (arg == "--checkpoint-interval" && hasValue) {
+			checkpointInterval = atof(argv[++a]);
+		} else if (arg == "--resume") {
+			resumeRender = true;
+		} else if (arg == "--time-budget" && hasValue) {
+			timeBudget = atoi(argv[++a]);
+			if (timeBudget <= 0) {
+				std::cerr << "--time-budget needs a positive number of "
+				          << "milliseconds." << std::endl;
+				exit(1);
+			}
+		} else if (arg == "--relight") {
+			relight = true;
+		} else if (arg == "--texture-cache" && hasValue) {
+			m_nTextureCacheMB = atoi(argv[++a]);
+			textureStats = true;
+		} else if (arg == "--out-of-core" && hasValue) {
+			pixelDir = argv[++a];
+		} else if (arg == "--heatmap") {
+			costMaps = true;
+		} else if (arg == "--aovs") {
+			aovs = true;
+		} else if (arg == "--denoise") {
+			denoise = true;
+		} else if (arg == "--trace-out" && hasValue) {
+			traceFile = argv[++a];
+			// Before anything worth timing, e.g. the cubemap below
+			Profiler::enable();
+			Profiler::nameThread("main");
+		} else {
+			argv[kept++] = argv[a];
+		}
+	}
+	argc = kept;
+	if ((tileCount > 0 || tileIndex >= 0) &&
+	    (tileIndex < 0 || tileIndex >= tileCount || hasRegion)) {
+		std::cerr << "--tiles N needs --tile-index k with 0 <= k < N, and "
+		          << "can't be combined with --region." << std::endl;
+		exit(1);
+	}
+
+	while ((i = getopt(argc, argv, "tr:w:hj:c:a:")) != EOF) {
 		switch (i) {
 			case 'r':
 				m_nDepth = atoi(optarg);
@@ -40,6 +168,9 @@ CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
 			case 'c':
 				cubemap_file = optarg;
 				break;
+			case 'a':
+				animfile = optarg;
+				break;
 			case 'h':
 				usage();
 				exit(1);
@@ -57,6 +188,47 @@ CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
 	if (!cubemap_file.empty()) {
 		smartLoadCubemap(cubemap_file);
 	}
+	if (animfile && !loadAnimation(animfile))
+		exit(1);
+	if (resumeRender && checkpointFile.empty()) {
+		std::cerr << "--resume needs --checkpoint FILE." << std::endl;
+		exit(1);
+	}
+	if (!checkpointFile.empty() && timeBudget > 0) {
+		std::cerr << "--checkpoint and --time-budget can't be combined."
+		          << std::endl;
+		exit(1);
+	}
+	if ((aovs || denoise) && (hasRegion || tileCount > 0)) {
+		std::cerr << "--aovs and --denoise are for whole images, not "
+		          << "--region or --tiles." << std::endl;
+		exit(1);
+	}
+	if (!checkpointFile.empty() && !m_frames.empty()) {
+		std::cerr << "Checkpoints are for single images, not animations."
+		          << std::endl;
+		exit(1);
+	}
+
+	if (bvhStatsMode) {
+		if (optind >= argc) {
+			std::cerr << "no input name." << std::endl;
+			exit(1);
+		}
+		rayName = argv[optind];
+		return;
+	}
+
+	if (mergeMode) {
+		if (optind >= argc - 1) {
+			std::cerr << "no output and/or tile names." << std::endl;
+			exit(1);
+		}
+		imgName = argv[optind];
+		for (int t = optind + 1; t < argc; t++)
+			tileNames.push_back(argv[t]);
+		return;
+	}
 
 	if (optind >= argc - 1) {
 		std::cerr << "no input and/or output name." << std::endl;
@@ -65,42 +237,389 @@ CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
 
 	rayName = argv[optind];
 	imgName = argv[optind + 1];
+	string check;
+	if (!m_frames.empty() && !frameFileName(imgName, 0, check)) {
+		std::cerr << "An animation's output name can only have one %d or "
+		          << "%0Nd in it, and %% for a percent sign." << std::endl;
+		exit(1);
+	}
+}
+
+// "out.png" -> "out.cost.png"
+static string siblingFileName(const string& name, const char* kind,
+                              const char* ext)
+{
+	size_t dot = name.find_last_of('.');
+	size_t slash = name.find_last_of("\\/");
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		dot = name.size();
+	return name.substr(0, dot) + "." + kind + ext;
+}
+
+// Write the cost buffer as it is, and its times as a false colour image:
+// black through purple and orange to pale yellow.  The scale tops out at
+// the 99th percentile so that a few outliers don't leave the rest dark.
+static void writeCostMaps(const string& name, int width, int height,
+                          const float* cost)
+{
+	string pfm = siblingFileName(name, "cost", ".pfm");
+	if (!writePFM(pfm.c_str(), width, height, cost))
+		std::cerr << "Unable to write '" << pfm << "'" << std::endl;
+
+	size_t pixels = (size_t)width * height;
+	std::vector<float> times(pixels);
+	for (size_t p = 0; p < pixels; p++)
+		times[p] = cost[p * 3];
+	std::nth_element(times.begin(), times.begin() + pixels * 99 / 100,
+	                 times.end());
+	float top = std::max(times[pixels * 99 / 100], 1e-3f);
+
+	static const float ramp[][3] = { { 0, 0, 4 },       { 87, 16, 110 },
+	                                 { 188, 55, 84 },   { 249, 142, 9 },
+	                                 { 252, 255, 164 } };
+	const int stops = sizeof(ramp) / sizeof(ramp[0]);
+	std::vector<unsigned char> image(pixels * 3);
+	for (size_t p = 0; p < pixels; p++) {
+		float v = std::min(cost[p * 3] / top, 1.0f) * (stops - 1);
+		int k = std::min((int)v, stops - 2);
+		float f = v - k;
+		for (int c = 0; c < 3; c++)
+			image[p * 3 + c] = (unsigned char)(ramp[k][c] * (1 - f) +
+			                                   ramp[k + 1][c] * f);
+	}
+	writeImage(siblingFileName(name, "cost", ".png").c_str(), width, height,
+	           image.data());
+}
+
+// Write every AOV plane next to the image, in floats: EXR if the image is,
+// PFM otherwise.
+static void writeAOVs(RayTracer* raytracer, const string& name)
+{
+	string tail = name.substr(name.size() - std::min<size_t>(name.size(), 4));
+	std::transform(tail.begin(), tail.end(), tail.begin(), ::tolower);
+	const char* ext = tail == ".exr" ? ".exr" : ".pfm";
+	for (int a = 0; a < RayTracer::AOV_COUNT; a++) {
+		RayTracer::AOV which = (RayTracer::AOV)a;
+		const float* plane;
+		int width, height;
+		raytracer->getAOVBuffer(which, plane, width, height);
+		if (!plane)
+			return;
+		string file = siblingFileName(name, RayTracer::aovName(which), ext);
+		std::unique_ptr<ImageWriter> out =
+		        openImageWriter(file.c_str(), width, height);
+		if (!out || !out->writeRows(0, height, plane) || !out->close())
+			std::cerr << "Unable to write '" << file << "'" << std::endl;
+	}
+}
+
+// Write out the bands of tile rows finished since the last call, or with
+// all set, every band not written yet.  Returns false once a write fails.
+static bool writeFinishedRows(RayTracer* raytracer, ImageWriter* out,
+                              std::vector<char>& written, bool all)
+{
+	const float* fbuf;
+	unsigned char* buf;
+	int width, height;
+	raytracer->getFloatBuffer(fbuf, width, height);
+	raytracer->getBuffer(buf, width, height);
+	written.resize(raytracer->tileRows(), 0);
+	for (int row = 0; row < raytracer->tileRows(); row++) {
+		int y0, y1;
+		if (written[row] || (!raytracer->tileRowDone(row, y0, y1) && !all))
+			continue;
+		ProfileScope span("image write", "rows", y0);
+		size_t offset = (size_t)y0 * width * 3;
+		if (out->isFloat() ? !out->writeRows(y0, y1, fbuf + offset)
+		                   : !out->writeRows(y0, y1, buf + offset))
+			return false;
+		written[row] = 1;
+	}
+	return true;
+}
+
+// Set by SIGINT/SIGTERM while a checkpointed render is running
+static volatile sig_atomic_t interrupted = 0;
+
+static void onInterrupt(int)
+{
+	interrupted = 1;
+}
+
+// Wait for the render started by traceImage(), saving a checkpoint every
+// checkpointInterval seconds.  If the process is told to stop, the tracer
+// finishes the tiles in flight and a last checkpoint is written so that
+// --resume loses no finished work.  Returns false if interrupted.
+bool CommandLineUI::renderWithCheckpoints(const string& signature)
+{
+	interrupted = 0;
+	void (*oldInt)(int) = signal(SIGINT, onInterrupt);
+	void (*oldTerm)(int) = signal(SIGTERM, onInterrupt);
+
+	auto last = std::chrono::steady_clock::now();
+	while (!raytracer->checkRender()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		if (interrupted) {
+			raytracer->stopTrace = true;
+			raytracer->waitRender();
+			break;
+		}
+		auto now = std::chrono::steady_clock::now();
+		if (std::chrono::duration<double>(now - last).count() >=
+		    checkpointInterval) {
+			if (!raytracer->writeCheckpoint(checkpointFile, signature))
+				std::cerr << "Unable to write checkpoint '"
+				          << checkpointFile << "'" << std::endl;
+			last = now;
+		}
+	}
+	raytracer->waitRender();
+
+	signal(SIGINT, oldInt);
+	signal(SIGTERM, oldTerm);
+	if (!interrupted)
+		return true;
+	if (raytracer->writeCheckpoint(checkpointFile, signature))
+		std::cerr << "Interrupted; " << raytracer->tilesFinished() << " of "
+		          << raytracer->tileCount() << " tiles saved to '"
+		          << checkpointFile << "'" << std::endl;
+	else
+		std::cerr << "Interrupted; unable to write checkpoint '"
+		          << checkpointFile << "'" << std::endl;
+	return false;
 }
 
 int CommandLineUI::run()
 {
 	assert(raytracer != 0);
+	if (mergeMode)
+		return merge();
+	if (bvhStatsMode)
+		return bvhReport();
+
+	int status;
+	{
+		ProfileScope span("total");
+		status = render();
+	}
+	if (!traceFile.empty()) {
+		if (!Profiler::write(traceFile))
+			std::cerr << "Unable to write trace '" << traceFile << "'"
+			          << std::endl;
+		// Phases that didn't run are left out.  "AA" is the time spent on
+		// the samples beyond each pixel's first, added up over all the
+		// workers; it is part of the pass that traced them.
+		char line[128];
+		for (const char* phase : { "parse", "BVH build", "texture load",
+		                           "primary pass", "AA pass", "AA",
+		                           "time-budgeted pass", "relight pass",
+		                           "denoise", "image write",
+		                           "total" }) {
+			double seconds = Profiler::total(phase);
+			if (seconds <= 0.0)
+				continue;
+			snprintf(line, sizeof(line), "%-18s %10.1f ms%s", phase,
+			         seconds * 1000.0,
+			         strcmp(phase, "AA") == 0 ? " (all workers)" : "");
+			std::cerr << line << std::endl;
+		}
+	}
+	if (textureStats && raytracer->sceneLoaded()) {
+		TextureCache::Stats stats =
+		        raytracer->getScene().getTextureCache().stats();
+		char line[160];
+		snprintf(line, sizeof(line),
+		         "textures: %d loaded, %lld tile hits, %lld misses, "
+		         "%lld evictions, peak %.1f MB",
+		         stats.loads, stats.hits, stats.misses, stats.evictions,
+		         stats.peakBytes / 1048576.0);
+		std::cerr << line << std::endl;
+	}
+	return status;
+}
+
+int CommandLineUI::render()
+{
+	raytracer->recordCost(costMaps);
+	// The denoiser is guided by the AOVs
+	raytracer->recordAOVs(aovs || denoise);
+	raytracer->keepHits(relight && m_frames.size() > 1);
+	raytracer->keepPixelsOnDisk(pixelDir);
+
+	// A time budget covers loading the scene for the first image
+	auto frameStart = std::chrono::steady_clock::now();
 	raytracer->loadScene(rayName);
 
 	if (raytracer->sceneLoaded()) {
 		int width = m_nSize;
 		int height = (int)(width / raytracer->aspectRatio() + 0.5);
 
-		raytracer->traceSetup(width, height);
-
-		clock_t start, end;
-		start = clock();
+		// Part of the frame to render, in image coordinates (rows from
+		// the top).  Every pixel is sampled the same way no matter which
+		// process traces it, so tiles merge without seams.
+		TileHeader tile = { width, height, 0, 0, width, height };
+		bool partial = hasRegion || tileCount > 0;
+		if (hasRegion) {
+			tile.x0 = min(regionX0, width);
+			tile.y0 = min(regionY0, height);
+			tile.x1 = min(regionX1, width);
+			tile.y1 = min(regionY1, height);
+			if (tile.x0 >= tile.x1 || tile.y0 >= tile.y1) {
+				std::cerr << "Region is outside the " << width << "x"
+				          << height << " frame." << std::endl;
+				return 1;
+			}
+		} else if (tileCount > 0) {
+			tile.y0 = (int)((long long)height * tileIndex / tileCount);
+			tile.y1 = (int)((long long)height * (tileIndex + 1) / tileCount);
+		}
+		if (partial)
+			raytracer->setRegion(tile.x0, height - tile.y1, tile.x1,
+			                     height - tile.y0);
 
-		raytracer->traceImage(width, height);
-		raytracer->waitRender();
-		if (aaSwitch()) {
-			raytracer->aaImage();
-			raytracer->waitRender();
+		// A checkpoint only fits the same scene file, settings, size
+		// and region.
+		string signature;
+		if (!checkpointFile.empty()) {
+			char geometry[128];
+			snprintf(geometry, sizeof(geometry), "%dx%d %d,%d,%d,%d",
+			         width, height, tile.x0, tile.y0, tile.x1, tile.y1);
+			signature = string(rayName) + "\n" + saveSettings() + "\n" +
+			            geometry;
 		}
 
-		end = clock();
+		// A still image is an animation with one unchanged frame.  The
+		// scene, its BVHs, textures and cubemap stay loaded throughout,
+		// and each frame is written out while the next one traces.
+		// Formats that can be written in bands (png, pfm, exr) instead go
+		// out straight from the tracer's buffers, each band of tiles as
+		// soon as it is done.
+		// A denoised image only goes out once it's all there.
+		bool streaming = !partial && !denoise && canStreamImage(imgName);
+		size_t frames = m_frames.empty() ? 1 : m_frames.size();
+		std::thread writer;
+		std::vector<unsigned char> pending;
+		std::vector<float> pendingTile;
+		for (size_t f = 0; f < frames; f++) {
+			if (!m_frames.empty() && !raytracer->applyFrame(m_frames[f])) {
+				if (writer.joinable())
+					writer.join();
+				return 1;
+			}
+
+			string name = imgName;
+			if (!m_frames.empty())
+				frameFileName(imgName, f, name);
+			std::unique_ptr<ImageWriter> out;
+			std::vector<char> written;
+			if (streaming) {
+				out = openImageWriter(name.c_str(), width, height);
+				if (!out)
+					std::cerr << "Unable to write '" << name << "'"
+					          << std::endl;
+			}
+
+			raytracer->traceSetup(width, height);
+			if (resumeRender &&
+			    raytracer->resumeFrom(checkpointFile, signature))
+				std::cerr << "Resuming from '" << checkpointFile << "'"
+				          << std::endl;
+
+			if (timeBudget > 0) {
+				ProfileScope span("time-budgeted pass");
+				double finished = raytracer->traceWithin(
+				        width, height,
+				        frameStart + std::chrono::milliseconds(timeBudget));
+				std::cerr << "Time budget: " << (int)(100.0 * finished)
+				          << "% of pixels finished" << std::endl;
+			} else if (f > 0 && relight && raytracer->relightImage()) {
+				ProfileScope span("relight pass");
+				raytracer->waitRender();
+			} else {
+				{
+					ProfileScope span("primary pass");
+					raytracer->traceImage(width, height);
+					if (out && checkpointFile.empty()) {
+						// Supersampling happens within this pass (see
+						// the "AA" spans), so finished tiles are final
+						bool ok = true;
+						while (!raytracer->checkRender()) {
+							std::this_thread::sleep_for(
+							        std::chrono::milliseconds(50));
+							ok = ok && writeFinishedRows(raytracer, out.get(),
+							                             written, false);
+						}
+						if (!ok)
+							out.reset();
+						raytracer->waitRender();
+					} else if (checkpointFile.empty())
+						raytracer->waitRender();
+					else if (!renderWithCheckpoints(signature))
+						return 1;
+				}
+			}
 
-		// save image
-		unsigned char* buf;
+			if (denoise) {
+				ProfileScope span("denoise");
+				raytracer->denoiseImage();
+			}
 
-		raytracer->getBuffer(buf, width, height);
+			// save image
+			unsigned char* buf;
 
-		if (buf)
-			writeImage(imgName, width, height, buf);
+			raytracer->getBuffer(buf, width, height);
 
-		double t = (double)(end - start) / CLOCKS_PER_SEC;
-		// int totalRays = TraceUI::resetCount();
-		// std::cout << "total time = " << t << " seconds, rays traced = " << totalRays << std::endl;
+			if (writer.joinable())
+				writer.join();
+			if (out && !(writeFinishedRows(raytracer, out.get(), written, true) &&
+			             out->close()))
+				std::cerr << "Error writing '" << name << "'" << std::endl;
+			if (costMaps) {
+				const float* cost;
+				raytracer->getCostBuffer(cost, width, height);
+				if (cost)
+					writeCostMaps(name, width, height, cost);
+			}
+			if (aovs)
+				writeAOVs(raytracer, name);
+			if (partial) {
+				const float* fbuf;
+				raytracer->getFloatBuffer(fbuf, width, height);
+				pendingTile.clear();
+				for (int y = tile.y0; y < tile.y1; y++) {
+					const float* row =
+					        fbuf + ((size_t)(height - y - 1) * width + tile.x0) * 3;
+					pendingTile.insert(pendingTile.end(), row,
+					                   row + (tile.x1 - tile.x0) * 3);
+				}
+				writer = std::thread([&pendingTile, name, tile]() {
+					Profiler::nameThread("writer");
+					ProfileScope span("image write", "phase", name);
+					if (!writeTile(name.c_str(), tile, pendingTile))
+						std::cerr << "Unable to write tile '" << name
+						          << "'" << std::endl;
+				});
+			} else if (buf && !streaming && !pixelDir.empty()) {
+				// No copy of an image that doesn't fit in memory
+				ProfileScope span("image write", "phase", name);
+				writeImage(name.c_str(), width, height, buf);
+			} else if (buf && !streaming) {
+				pending.assign(buf, buf + width * height * 3);
+				writer = std::thread([&pending, name, width, height]() {
+					Profiler::nameThread("writer");
+					ProfileScope span("image write", "phase", name);
+					writeImage(name.c_str(), width, height,
+					           pending.data());
+				});
+			}
+
+			frameStart = std::chrono::steady_clock::now();
+		}
+		if (writer.joinable())
+			writer.join();
+		// The image is out; nothing left to resume
+		if (!checkpointFile.empty())
+			remove(checkpointFile.c_str());
 		return 0;
 	} else {
 		std::cerr << "Unable to load ray file '" << rayName << "'"
@@ -109,6 +628,115 @@ int CommandLineUI::run()
 	}
 }
 
+// Assemble tile files from partial renders into one image.
+int CommandLineUI::merge()
+{
+	int width = 0, height = 0;
+	long long covered = 0;
+	std::vector<unsigned char> image;
+	for (const auto& name : tileNames) {
+		TileHeader tile;
+		std::vector<float> rgb;
+		if (!readTile(name.c_str(), tile, rgb)) {
+			std::cerr << "Unable to read tile '" << name << "'"
+			          << std::endl;
+			return 1;
+		}
+		if (image.empty()) {
+			width = tile.width;
+			height = tile.height;
+			image.assign((size_t)width * height * 3, 0);
+		} else if (tile.width != width || tile.height != height) {
+			std::cerr << "Tile '" << name << "' is from a "
+			          << tile.width << "x" << tile.height
+			          << " frame, not " << width << "x" << height
+			          << std::endl;
+			return 1;
+		}
+
+		// Same quantization as RayTracer::tracePixel; the image buffer
+		// is stored bottom-up.
+		const float* src = rgb.data();
+		for (int y = tile.y0; y < tile.y1; y++) {
+			unsigned char* dst =
+			        image.data() + ((size_t)(height - y - 1) * width + tile.x0) * 3;
+			for (int x = tile.x0; x < tile.x1; x++)
+				for (int c = 0; c < 3; c++)
+					*dst++ = (int)(255.0 * *src++);
+		}
+		covered += (long long)(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+	}
+	if (covered != (long long)width * height)
+		std::cerr << "Warning: tiles cover " << covered << " of "
+		          << (long long)width * height << " pixels" << std::endl;
+	writeImage(imgName, width, height, image.data());
+	return 0;
+}
+
+static void printBVHStats(const char* title, const BVHStats& stats)
+{
+	std::cout << title << std::endl;
+	if (stats.nodes == 0) {
+		std::cout << "  empty" << std::endl;
+		return;
+	}
+	int minDepth = 0;
+	double meanDepth = 0.0;
+	for (int d = (int)stats.leafDepths.size() - 1; d >= 0; d--) {
+		if (stats.leafDepths[d])
+			minDepth = d;
+		meanDepth += (double)d * stats.leafDepths[d] / stats.leaves;
+	}
+	char line[256];
+	snprintf(line, sizeof(line),
+	         "  nodes %lld, leaves %lld, primitives %lld, %.1f KB\n"
+	         "  leaf depth %d..%d, mean %.1f\n"
+	         "  SAH cost %.3f, sibling overlap %.1f%%",
+	         stats.nodes, stats.leaves, stats.primitives,
+	         stats.bytes / 1024.0, minDepth,
+	         (int)stats.leafDepths.size() - 1, meanDepth, stats.sah,
+	         stats.overlap * 100.0);
+	std::cout << line << std::endl << "  leaves by depth:";
+	for (size_t d = 0; d < stats.leafDepths.size(); d++)
+		if (stats.leafDepths[d])
+			std::cout << " " << d << ":" << stats.leafDepths[d];
+	std::cout << std::endl << "  leaves by size:";
+	for (const auto& size : stats.leafSizes)
+		std::cout << " " << size.first << ":" << size.second;
+	std::cout << std::endl;
+}
+
+// Load the scene, which builds its BVHs, and describe them: the scene's
+// tree over objects, then the face tree of every distinct triangle mesh.
+int CommandLineUI::bvhReport()
+{
+	if (!raytracer->loadScene(rayName)) {
+		std::cerr << "Unable to load ray file '" << rayName << "'"
+		          << std::endl;
+		return 1;
+	}
+	const Scene& scene = raytracer->getScene();
+	char title[256];
+	snprintf(title, sizeof(title), "scene: %d objects",
+	         (int)scene.getAllObjs().size());
+	printBVHStats(title, bvhStats(scene.getBVH()));
+
+	std::vector<const Trimesh*> meshes;
+	for (const auto& obj : scene.getAllObjs()) {
+		const Trimesh* mesh = dynamic_cast<const Trimesh*>(obj.get());
+		if (auto instance = dynamic_cast<const TrimeshInstance*>(obj.get()))
+			mesh = instance->getMesh();
+		if (mesh && std::find(meshes.begin(), meshes.end(), mesh) == meshes.end())
+			meshes.push_back(mesh);
+	}
+	for (size_t m = 0; m < meshes.size(); m++) {
+		snprintf(title, sizeof(title), "trimesh %d: %d faces",
+		         (int)m, (int)meshes[m]->numFaces());
+		printBVHStats(title, bvhStats(meshes[m]->root));
+	}
+	return 0;
+}
+
 void CommandLineUI::alert(const string& msg)
 {
 	std::cerr << msg << std::endl;
@@ -119,8 +747,26 @@ void CommandLineUI::usage()
 	using namespace std;
 	cerr << "usage: " << progName
 	     << " [options] [input.ray output.png]" << endl
+	     << "       (.bmp and .png are 8-bit, .pfm and .exr float; all but .bmp are written as tiles finish)" << endl
+	     << "       " << progName << " --merge output.png tile..." << endl
+	     << "       " << progName << " --bvh-stats [options] input.ray" << endl
+	     << "       " << progName << " --serve [options] socket  (see --serve -h)" << endl
 	     << "  -r <#>      set recursion level (default " << m_nDepth << ")" << endl
 	     << "  -w <#>      set output image width (default " << m_nSize << ")" << endl
 	     << "  -j <FILE>   set parameters from JSON file" << endl
-	     << "  -c <FILE>   one Cubemap file, the remainings will be detected automatically" << endl;
+	     << "  -c <FILE>   one Cubemap file, the remainings will be detected automatically" << endl
+	     << "  -a <FILE>   render the frames of a JSON animation, numbering the outputs" << endl
+	     << "  --region x0,y0,x1,y1       only render this part, into a float tile file" << endl
+	     << "  --tiles N --tile-index k   only render band k of N, into a float tile file" << endl
+	     << "  --checkpoint <FILE>        save render progress to FILE while tracing" << endl
+	     << "  --checkpoint-interval <#>  seconds between checkpoints (default " << checkpointInterval << ")" << endl
+	     << "  --resume                   continue from the --checkpoint file if it matches" << endl
+	     << "  --time-budget <MS>         write the best image ready within MS milliseconds" << endl
+	     << "  --relight                  with -a, shade frames where only lights change from stored hits" << endl
+	     << "  --texture-cache <MB>       page textures in tiles, holding at most MB, and report use" << endl
+	     << "  --out-of-core <DIR>        keep the image in a scratch file in DIR, for images bigger than memory" << endl
+	     << "  --aovs                     also write depth, normal, albedo, id and uv planes as OUTPUT.depth.pfm etc." << endl
+	     << "  --denoise                  filter the noise out of the image, guided by the AOVs" << endl
+	     << "  --heatmap                  also write per-pixel cost as OUTPUT.cost.png/.pfm" << endl
+	     << "  --trace-out <FILE>         save a Chrome/Perfetto trace of the render to FILE" << endl;
 }
@@ -8,6 +8,7 @@
 #define __CommandLineUI_h__
 
 #include "TraceUI.h"
+#include <vector>
 
 class CommandLineUI : public TraceUI {
 
@@ -19,10 +20,57 @@ public:
 
 private:
 	void		usage();
+	int		merge();
+	int		render();
+	int		bvhReport();
+	bool		renderWithCheckpoints(const string& signature);
 
 	char*	rayName;
 	char*	imgName;
 	char*	progName;
+
+	// Partial renders: an explicit region, or band tileIndex of tileCount
+	// horizontal bands.  Either one writes a float tile file.
+	bool	hasRegion = false;
+	int	regionX0, regionY0, regionX1, regionY1;
+	int	tileCount = 0;
+	int	tileIndex = -1;
+
+	// Periodically save progress to checkpointFile; with resumeRender a
+	// matching checkpoint found there is picked up first.
+	string	checkpointFile;
+	double	checkpointInterval = 60.0;
+	bool	resumeRender = false;
+
+	// Milliseconds per image, or 0 to always render at full quality
+	int	timeBudget = 0;
+
+	// Chrome trace of where the time went, written when run() ends
+	string	traceFile;
+
+	// Also write what each pixel cost, as name.cost.png and name.cost.pfm
+	bool	costMaps = false;
+
+	// Also write the AOV planes, as name.depth.pfm, name.normal.pfm, ...
+	// (.exr if the image is)
+	bool	aovs = false;
+
+	// Filter the noise out of each image before it is written
+	bool	denoise = false;
+
+	// Shade animation frames that only change lights from the hits of
+	// the previous frame instead of tracing them
+	bool	relight = false;
+
+	// Keep the image in a scratch file here instead of in memory
+	string	pixelDir;
+
+	// Print how the texture cache did (set by --texture-cache)
+	bool	textureStats = false;
+
+	bool	mergeMode = false;
+	bool	bvhStatsMode = false;
+	std::vector<string> tileNames;
 };
 
 #endif
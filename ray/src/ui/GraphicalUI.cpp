@@ -29,7 +29,6 @@
 bool GraphicalUI::stopTrace = false;
 GraphicalUI* GraphicalUI::pUI = NULL;
 const char* GraphicalUI::traceWindowLabel = "Raytraced Image";
-bool TraceUI::m_debug = false;
 
 //------------------------------------- Help Functions --------------------------------------------
 GraphicalUI* GraphicalUI::whoami(Fl_Menu_* o)	// from menu item back to UI itself
@@ -283,7 +282,9 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 		auto t_start = std::chrono::high_resolution_clock::now();
 		auto t_now = t_start;
 		auto t_elapsed = std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
-		pUI->raytracer->traceImage(width, height);
+		// After a settings change, only the pixels it affects are traced
+		if (!pUI->raytracer->updateImage(width, height))
+			pUI->raytracer->traceImage(width, height);
 		clock_t intervalMS = pUI->refreshInterval * 100;
 		while (!pUI->raytracer->checkRender())
 		{
@@ -0,0 +1,584 @@
+#ifndef _WIN32
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "RenderServer.h"
+#include "../RayTracer.h"
+#include "../fileio/pngimage.h"
+#include "../scene/scene.h"
+
+#include "json.hpp"
+using Json = nlohmann::json;
+
+using namespace std;
+
+// The protocol is line based.  Each request is one JSON object on a line:
+//
+//   {"cmd": "render", "id": "a1", "scene": "/abs/path/scene.ray",
+//    "width": 512, "height": 384, "format": "png",
+//    "camera": {"position": [0, 2, 8], "look_at": [0, 0, 0]},
+//    "settings": {"recursion_depth": 3, "anti_alias": true},
+//    "time_budget": 250}
+//   {"cmd": "cancel", "id": "a1"}
+//   {"cmd": "stats"}
+//   {"cmd": "shutdown"}
+//
+// and every reply is one JSON object on a line.  A render is acknowledged
+// with {"id": ..., "status": "queued"} as soon as it is queued, and once it
+// is finished the connection gets {"id": ..., "status": "done", "width": w,
+// "height": h, "format": ..., "bytes": n} followed by n bytes of image
+// data: a PNG file, or for "raw" the RGB rows from top to bottom.  Width
+// and height are at most MAX_IMAGE_SIDE.  Height, camera and settings are
+// optional; settings use the names from the -j
+// file and apply to that job only.  Parsed scenes are cached by path and
+// modification time, so changing a scene file invalidates its entry.
+//
+// With a time budget (milliseconds, counted from when the request arrives)
+// the job renders a single-sample preview and anti-aliases what it can
+// before the deadline; the reply's "finished" is the fraction of
+// pixels that need no more work (see RayTracer::finishedFraction()).
+struct RenderServer::Job {
+	string id;
+	string scene;
+	int width = 0;
+	int height = 0;
+	bool png = true;
+	string camera;
+	string settings;
+	int timeBudget = 0;
+	chrono::steady_clock::time_point received;
+
+	JobState state = QUEUED;
+	std::atomic<bool> cancelRequested{false};
+	string error;
+	int outWidth = 0;
+	int outHeight = 0;
+	double finishedFraction = 1.0;
+	vector<uint8_t> image;
+	condition_variable finished;
+};
+
+namespace {
+// Largest width or height a job may ask for, so that one request can't
+// make the tracer allocate more than the machine has
+const int MAX_IMAGE_SIDE = 16384;
+
+bool sendAll(int fd, const void* data, size_t len)
+{
+	const char* p = (const char*)data;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool sendJson(int fd, const Json& reply)
+{
+	string line = reply.dump() + "\n";
+	return sendAll(fd, line.data(), line.size());
+}
+
+const char* stateName(int state)
+{
+	switch (state) {
+		case RenderServer::QUEUED: return "queued";
+		case RenderServer::RUNNING: return "running";
+		case RenderServer::DONE: return "done";
+		case RenderServer::CANCELLED: return "cancelled";
+		default: return "error";
+	}
+}
+} // anonymous namespace
+
+RenderServer::RenderServer(int argc, char** argv) : TraceUI()
+{
+	int i;
+	progName = argv[0];
+	const char* jsonfile = nullptr;
+	string cubemap_file;
+	// Skip "--serve"; getopt() treats it as the program name.
+	while ((i = getopt(argc - 1, argv + 1, "hj:c:n:")) != EOF) {
+		switch (i) {
+			case 'j':
+				jsonfile = optarg;
+				break;
+			case 'c':
+				cubemap_file = optarg;
+				break;
+			case 'n':
+				cacheCapacity = max(1, atoi(optarg));
+				break;
+			case 'h':
+				usage();
+				exit(1);
+			default:
+				usage();
+				exit(1);
+		}
+	}
+	if (jsonfile)
+		loadFromJson(jsonfile);
+	if (!cubemap_file.empty())
+		smartLoadCubemap(cubemap_file);
+
+	if (optind + 1 >= argc) {
+		std::cerr << "no socket name." << std::endl;
+		exit(1);
+	}
+	socketPath = argv[optind + 1];
+	baseSettings = saveSettings();
+}
+
+RenderServer::~RenderServer()
+{
+	if (listenFd >= 0)
+		close(listenFd);
+}
+
+void RenderServer::usage()
+{
+	cerr << "usage: " << progName << " --serve [options] socket" << endl
+	     << "  -j <FILE>   set default parameters from JSON file" << endl
+	     << "  -c <FILE>   one Cubemap file, the remainings will be detected automatically" << endl
+	     << "  -n <#>      number of parsed scenes to keep (default " << cacheCapacity << ")" << endl;
+}
+
+void RenderServer::alert(const string& msg)
+{
+	// Only the render thread loads scenes, so this is where their errors
+	// end up.
+	lastAlert = msg;
+	std::cerr << msg << std::endl;
+}
+
+int RenderServer::run()
+{
+	assert(raytracer != 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(addr.sun_path)) {
+		cerr << "Socket name too long: " << socketPath << endl;
+		return 1;
+	}
+	strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketPath.c_str());
+	if (listenFd < 0 ||
+	    ::bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	    listen(listenFd, 16) < 0) {
+		cerr << "Unable to listen on " << socketPath << ": "
+		     << strerror(errno) << endl;
+		return 1;
+	}
+	cerr << "Listening on " << socketPath << endl;
+
+	thread renderer(&RenderServer::renderLoop, this);
+	for (;;) {
+		int fd = accept(listenFd, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		{
+			lock_guard<mutex> lock(jobMutex);
+			if (shuttingDown) {
+				close(fd);
+				break;
+			}
+		}
+		thread(&RenderServer::serveClient, this, fd).detach();
+	}
+	renderer.join();
+	unlink(socketPath.c_str());
+	return 0;
+}
+
+void RenderServer::serveClient(int fd)
+{
+	string pending;
+	char chunk[4096];
+	for (;;) {
+		size_t eol = pending.find('\n');
+		if (eol == string::npos) {
+			ssize_t n = read(fd, chunk, sizeof(chunk));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			pending.append(chunk, n);
+			continue;
+		}
+		string line = pending.substr(0, eol);
+		pending.erase(0, eol + 1);
+		if (line.find_first_not_of(" \t\r") == string::npos)
+			continue;
+
+		// Any field of the wrong type makes nlohmann throw, so every
+		// access to the request happens inside a try.
+		Json request;
+		string cmd;
+		try {
+			request = Json::parse(line);
+			if (!request.is_object()) {
+				sendJson(fd, {{"status", "error"},
+				              {"message", "request must be a JSON object"}});
+				continue;
+			}
+			cmd = request.value("cmd", "");
+		} catch (Json::exception& e) {
+			sendJson(fd, {{"status", "error"}, {"message", e.what()}});
+			continue;
+		}
+
+		if (cmd == "render") {
+			auto job = make_shared<Job>();
+			job->received = chrono::steady_clock::now();
+			try {
+				if (request.count("id"))
+					job->id = request.at("id").get<string>();
+				job->scene = request.at("scene").get<string>();
+				job->width = request.value("width", 0);
+				job->height = request.value("height", 0);
+				job->png = request.value("format", "png") != "raw";
+				job->timeBudget = request.value("time_budget", 0);
+				if (request.count("camera"))
+					job->camera = request["camera"].dump();
+				if (request.count("settings"))
+					job->settings = request["settings"].dump();
+			} catch (Json::exception& e) {
+				sendJson(fd, {{"status", "error"}, {"message", e.what()}});
+				continue;
+			}
+			// 0 (or no size) means the default
+			if (job->width < 0 || job->width > MAX_IMAGE_SIDE ||
+			    job->height < 0 || job->height > MAX_IMAGE_SIDE) {
+				sendJson(fd, {{"status", "error"},
+				              {"message", "width and height must be 1 to " +
+				                                  to_string(MAX_IMAGE_SIDE)}});
+				continue;
+			}
+
+			unique_lock<mutex> lock(jobMutex);
+			if (shuttingDown) {
+				lock.unlock();
+				sendJson(fd, {{"status", "error"},
+				              {"message", "server is shutting down"}});
+				continue;
+			}
+			if (job->id.empty())
+				job->id = "job-" + to_string(nextJobId);
+			nextJobId++;
+			queue.push_back(job);
+			jobReady.notify_one();
+			Json ack = {{"id", job->id}, {"status", "queued"},
+			            {"position", queue.size()}};
+			lock.unlock();
+			if (!sendJson(fd, ack))
+				break;
+
+			lock.lock();
+			job->finished.wait(lock, [&job]() {
+				return job->state != QUEUED &&
+				       job->state != RUNNING;
+			});
+			lock.unlock();
+
+			Json reply = {{"id", job->id}, {"status", stateName(job->state)}};
+			if (job->state == DONE) {
+				reply["width"] = job->outWidth;
+				reply["height"] = job->outHeight;
+				reply["format"] = job->png ? "png" : "raw";
+				reply["bytes"] = job->image.size();
+				if (job->timeBudget > 0)
+					reply["finished"] = job->finishedFraction;
+			} else if (job->state == FAILED) {
+				reply["message"] = job->error;
+			}
+			if (!sendJson(fd, reply))
+				break;
+			if (job->state == DONE &&
+			    !sendAll(fd, job->image.data(), job->image.size()))
+				break;
+		} else if (cmd == "cancel") {
+			string id;
+			try {
+				id = request.value("id", "");
+			} catch (Json::exception& e) {
+				sendJson(fd, {{"status", "error"}, {"message", e.what()}});
+				continue;
+			}
+			bool found = false;
+			lock_guard<mutex> lock(jobMutex);
+			for (auto it = queue.begin(); it != queue.end(); ++it) {
+				if ((*it)->id == id) {
+					(*it)->state = CANCELLED;
+					(*it)->finished.notify_all();
+					queue.erase(it);
+					jobsCancelled++;
+					found = true;
+					break;
+				}
+			}
+			if (!found && running && running->id == id) {
+				// The flag must be set before stopping the tracer;
+				// renderJob() checks it after starting the workers.
+				running->cancelRequested = true;
+				raytracer->stopTrace = true;
+				found = true;
+			}
+			if (found)
+				sendJson(fd, {{"id", id}, {"status", "cancelled"}});
+			else
+				sendJson(fd, {{"id", id}, {"status", "error"},
+				              {"message", "no such job"}});
+		} else if (cmd == "stats") {
+			Json stats;
+			{
+				lock_guard<mutex> lock(jobMutex);
+				stats = {{"status", "ok"},
+				         {"queued", queue.size()},
+				         {"done", jobsDone},
+				         {"cancelled", jobsCancelled},
+				         {"failed", jobsFailed},
+				         {"rays", raysTraced},
+				         {"render_seconds", renderSeconds}};
+				stats["running"] = running ? Json(running->id) : Json();
+				stats["cache"] = {{"entries", sceneCache.size()},
+				                  {"capacity", cacheCapacity},
+				                  {"hits", cacheHits},
+				                  {"misses", cacheMisses}};
+			}
+			sendJson(fd, stats);
+		} else if (cmd == "shutdown") {
+			{
+				lock_guard<mutex> lock(jobMutex);
+				shuttingDown = true;
+				for (auto& job : queue) {
+					job->state = CANCELLED;
+					job->finished.notify_all();
+					jobsCancelled++;
+				}
+				queue.clear();
+				if (running) {
+					running->cancelRequested = true;
+					raytracer->stopTrace = true;
+				}
+				jobReady.notify_all();
+			}
+			sendJson(fd, {{"status", "ok"}});
+			::shutdown(listenFd, SHUT_RDWR);
+		} else {
+			sendJson(fd, {{"status", "error"},
+			              {"message", "unknown command '" + cmd + "'"}});
+		}
+	}
+	close(fd);
+}
+
+void RenderServer::renderLoop()
+{
+	for (;;) {
+		shared_ptr<Job> job;
+		{
+			unique_lock<mutex> lock(jobMutex);
+			jobReady.wait(lock, [this]() {
+				return shuttingDown || !queue.empty();
+			});
+			if (shuttingDown)
+				return;
+			job = queue.front();
+			queue.pop_front();
+			job->state = RUNNING;
+			running = job;
+		}
+
+		auto start = chrono::steady_clock::now();
+		// One job running out of memory mustn't take the server down
+		JobState state;
+		try {
+			state = renderJob(*job);
+		} catch (std::exception& e) {
+			job->error = string("render failed: ") + e.what();
+			state = FAILED;
+		}
+		double seconds = chrono::duration<double>(
+		        chrono::steady_clock::now() - start).count();
+
+		lock_guard<mutex> lock(jobMutex);
+		job->state = state;
+		running.reset();
+		renderSeconds += seconds;
+		raysTraced += TraceUI::resetCount();
+		if (job->state == DONE)
+			jobsDone++;
+		else if (job->state == CANCELLED)
+			jobsCancelled++;
+		else
+			jobsFailed++;
+		job->finished.notify_all();
+	}
+}
+
+// Runs on the render thread and returns the job's final state, which the
+// caller publishes under the lock together with the result.
+RenderServer::JobState RenderServer::renderJob(Job& job)
+{
+	lastAlert.clear();
+	try {
+		loadSettings(baseSettings);
+		if (!job.settings.empty())
+			loadSettings(job.settings);
+	} catch (Json::exception& e) {
+		job.error = string("bad settings: ") + e.what();
+		return FAILED;
+	}
+
+	shared_ptr<Scene> scene = findScene(job.scene);
+	if (!scene) {
+		job.error = lastAlert.empty() ? "unable to load " + job.scene
+		                              : lastAlert;
+		return FAILED;
+	}
+	raytracer->setScene(scene);
+
+	// The scene stays cached for later jobs, so its camera is put back
+	// once this one is done with it.
+	Camera saved = scene->getCamera();
+	FrameUpdate frame;
+	try {
+		if (!job.camera.empty())
+			frame.camera = loadCamera(job.camera);
+	} catch (Json::exception& e) {
+		job.error = string("bad camera: ") + e.what();
+		return FAILED;
+	}
+	if (!raytracer->applyFrame(frame)) {
+		job.error = lastAlert;
+		scene->getCamera() = saved;
+		return FAILED;
+	}
+
+	int width = job.width > 0 ? job.width : m_nSize;
+	int height = job.height > 0
+	                     ? job.height
+	                     : (int)(width / raytracer->aspectRatio() + 0.5);
+	if (height < 1 || height > MAX_IMAGE_SIDE) {
+		job.error = "height must be 1 to " + to_string(MAX_IMAGE_SIDE);
+		scene->getCamera() = saved;
+		return FAILED;
+	}
+	if (job.height > 0)
+		scene->getCamera().setAspectRatio((double)width / height);
+
+	// Restores the camera if the trace throws (e.g. bad_alloc), before
+	// renderLoop() reports it
+	try {
+		if (job.timeBudget > 0) {
+			job.finishedFraction = raytracer->traceWithin(
+			        width, height,
+			        job.received + chrono::milliseconds(job.timeBudget),
+			        &job.cancelRequested);
+		} else {
+			// Starting a pass clears stopTrace, so a cancel that arrived
+			// just before is applied again after each start.
+			raytracer->traceImage(width, height);
+			if (job.cancelRequested)
+				raytracer->stopTrace = true;
+			raytracer->waitRender();
+			if (aaSwitch() && !job.cancelRequested) {
+				raytracer->aaImage();
+				if (job.cancelRequested)
+					raytracer->stopTrace = true;
+				raytracer->waitRender();
+			}
+		}
+	} catch (...) {
+		scene->getCamera() = saved;
+		throw;
+	}
+	scene->getCamera() = saved;
+
+	if (job.cancelRequested)
+		return CANCELLED;
+
+	unsigned char* buf;
+	raytracer->getBuffer(buf, width, height);
+	job.outWidth = width;
+	job.outHeight = height;
+	if (job.png) {
+		try {
+			job.image = encodePNG(width, height, buf);
+		} catch (string& e) {
+			job.error = e;
+			return FAILED;
+		}
+	} else {
+		// The buffer is bottom-up; clients get the rows top-down.
+		size_t row = (size_t)width * 3;
+		job.image.resize(row * height);
+		for (int y = 0; y < height; y++)
+			memcpy(job.image.data() + y * row,
+			       buf + (height - y - 1) * row, row);
+	}
+	return DONE;
+}
+
+shared_ptr<Scene> RenderServer::findScene(const string& path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		lastAlert = "Error: couldn't read scene file " + path;
+		return nullptr;
+	}
+	long long mtime = (long long)st.st_mtime;
+
+	{
+		lock_guard<mutex> lock(jobMutex);
+		for (auto it = sceneCache.begin(); it != sceneCache.end(); ++it) {
+			if (it->path != path)
+				continue;
+			if (it->mtime == mtime) {
+				sceneCache.splice(sceneCache.begin(), sceneCache, it);
+				cacheHits++;
+				return sceneCache.front().scene;
+			}
+			// Stale: the file changed since it was parsed.
+			sceneCache.erase(it);
+			break;
+		}
+		cacheMisses++;
+	}
+
+	shared_ptr<Scene> scene(raytracer->readScene(path.c_str()));
+	if (!scene)
+		return nullptr;
+
+	lock_guard<mutex> lock(jobMutex);
+	sceneCache.push_front({path, mtime, scene});
+	while (sceneCache.size() > cacheCapacity)
+		sceneCache.pop_back();
+	return scene;
+}
+
+#endif // _WIN32
@@ -0,0 +1,78 @@
+//
+// RenderServer.h
+//
+// A long-running UI that renders jobs sent over a Unix domain socket, so
+// that callers don't pay for scene loading and BVH construction on every
+// image.
+//
+
+#ifndef __RenderServer_h__
+#define __RenderServer_h__
+
+#include "TraceUI.h"
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class Scene;
+
+class RenderServer : public TraceUI {
+public:
+	RenderServer(int argc, char** argv);
+	~RenderServer();
+
+	int run();
+	void alert(const string& msg);
+
+	struct Job;
+	enum JobState { QUEUED, RUNNING, DONE, CANCELLED, FAILED };
+
+private:
+	void usage();
+
+	void serveClient(int fd);
+	void renderLoop();
+	JobState renderJob(Job& job);
+
+	// Parsed scenes, most recently used first.  An entry is only reused if
+	// the file hasn't been modified since it was parsed.
+	std::shared_ptr<Scene> findScene(const string& path);
+	struct CachedScene {
+		string path;
+		long long mtime;
+		std::shared_ptr<Scene> scene;
+	};
+	std::list<CachedScene> sceneCache;
+	size_t cacheCapacity = 4;
+	int cacheHits = 0;
+	int cacheMisses = 0;
+
+	// Jobs waiting to render; the render thread takes them in order and
+	// runs each across all tile workers.
+	std::mutex jobMutex;
+	std::condition_variable jobReady;
+	std::deque<std::shared_ptr<Job>> queue;
+	std::shared_ptr<Job> running;
+	int nextJobId = 1;
+	int jobsDone = 0;
+	int jobsCancelled = 0;
+	int jobsFailed = 0;
+	long long raysTraced = 0;
+	double renderSeconds = 0.0;
+	bool shuttingDown = false;
+
+	// Settings from the command line; each job starts from these.
+	string baseSettings;
+	string lastAlert;
+
+	char* progName;
+	string socketPath;
+	int listenFd = -1;
+};
+
+#endif
@@ -7,6 +7,7 @@
 #endif
 #include "../scene/cubeMap.h"
 #include "../scene/material.h"
+#include "../profile.h"
 
 /*
  * JSON for Modern C++
@@ -15,8 +16,20 @@
  */
 #include "json.hpp"
 using Json = nlohmann::json;
+#include <algorithm>
+#include <exception>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <thread>
+#include <glm/gtx/transform.hpp>
+
+// The UI in charge; the tracer reads its settings through this.
+TraceUI* traceUI = nullptr;
+int TraceUI::m_threads = std::max(std::thread::hardware_concurrency(), (unsigned)1);
+int TraceUI::rayCount[MAX_THREADS];
+long long TraceUI::nodeVisits[MAX_THREADS];
+bool TraceUI::m_debug = false;
 
 namespace {
 template <typename T>
@@ -41,29 +54,30 @@ TraceUI::~TraceUI()
 void TraceUI::setCubeMap(CubeMap* cm)
 {
 	cubemap.reset(cm);
+	m_cubeMapVersion++;
 }
 
-void TraceUI::loadFromJson(const char* file)
+// Every setting that can be given in a JSON file, by name
+template <typename F>
+void TraceUI::settingFields(F field)
 {
-	std::ifstream fin(file);
-	Json json;
-	fin >> json;
-
-	load(json, "threads", m_threads);
-	load(json, "size", m_nSize);
-	load(json, "recursion_depth", m_nDepth);
-	load(json, "threshold", m_nThreshold);
-	load(json, "blocksize", m_nBlockSize);
-	load(json, "supersamples", m_nSuperSamples);
-	load(json, "aa_threshold", m_nAaThreshold);
-	load(json, "tree_depth", m_nTreeDepth);
-	load(json, "leaf_size", m_nLeafSize);
-	load(json, "filter_width", m_nFilterWidth);
-	load(json, "anti_alias", m_antiAlias);
-	load(json, "kdtree", m_kdTree);
-	load(json, "shadows", m_shadows);
-	load(json, "smoothshade", m_smoothshade);
-	load(json, "backface_culling", m_backface);
+	field("threads", m_threads);
+	field("size", m_nSize);
+	field("recursion_depth", m_nDepth);
+	field("threshold", m_nThreshold);
+	field("blocksize", m_nBlockSize);
+	field("supersamples", m_nSuperSamples);
+	field("aa_threshold", m_nAaThreshold);
+	field("tree_depth", m_nTreeDepth);
+	field("leaf_size", m_nLeafSize);
+	field("filter_width", m_nFilterWidth);
+	field("anti_alias", m_antiAlias);
+	field("kdtree", m_kdTree);
+	field("shadows", m_shadows);
+	field("smoothshade", m_smoothshade);
+	field("backface_culling", m_backface);
+	field("rebuild_threshold", m_nRebuildThreshold);
+	field("texture_cache_mb", m_nTextureCacheMB);
 	/*
 	 * Note for Students:
 	 * The following options are legacy from previous semesters.
@@ -71,8 +85,355 @@ void TraceUI::loadFromJson(const char* file)
 	 * THE DEFAULT VALUE (DEFINED IN TraceUI.h) IS THE EXPECTED BEHAVIOUR.
 	 * DO NOT CHANGE THEM IN YOUR ASSIGNMENT.
 	 */
-	load(json, "internal_reflection", m_internalReflection);
-	load(json, "backface_specular", m_backfaceSpecular);
+	field("internal_reflection", m_internalReflection);
+	field("backface_specular", m_backfaceSpecular);
+}
+
+void TraceUI::loadFromJson(const char* file)
+{
+	std::ifstream fin(file);
+	Json json;
+	fin >> json;
+
+	settingFields([&json](const char* name, auto& target) {
+		load(json, name, target);
+	});
+}
+
+void TraceUI::loadSettings(const string& text)
+{
+	Json json = Json::parse(text);
+	settingFields([&json](const char* name, auto& target) {
+		load(json, name, target);
+	});
+}
+
+string TraceUI::saveSettings()
+{
+	Json json;
+	settingFields([&json](const char* name, auto& target) {
+		json[name] = target;
+	});
+	return json.dump();
+}
+
+namespace {
+glm::dvec3 vec3FromJson(const Json& j)
+{
+	return glm::dvec3(j.at(0).get<double>(), j.at(1).get<double>(),
+	                  j.at(2).get<double>());
+}
+
+// An object's transform is either a full "transform" matrix, given row by
+// row like in .ray files, or built from "translate", "rotate" (axis and
+// angle in radians) and "scale", applied in that order to the object.
+ObjectUpdate objectFromJson(const string& name, const Json& j)
+{
+	ObjectUpdate update;
+	update.name = name;
+	if (j.count("transform")) {
+		const Json& m = j["transform"];
+		for (int row = 0; row < 4; row++)
+			for (int col = 0; col < 4; col++)
+				update.transform[col][row] = m.at(row).at(col).get<double>();
+		update.hasTransform = true;
+	} else {
+		glm::dmat4x4 xform(1.0);
+		if (j.count("translate")) {
+			xform = xform * glm::translate(vec3FromJson(j["translate"]));
+			update.hasTransform = true;
+		}
+		if (j.count("rotate")) {
+			const Json& r = j["rotate"];
+			xform = xform * glm::rotate(r.at(3).get<double>(),
+			                            vec3FromJson(r));
+			update.hasTransform = true;
+		}
+		if (j.count("scale")) {
+			xform = xform * glm::scale(vec3FromJson(j["scale"]));
+			update.hasTransform = true;
+		}
+		update.transform = xform;
+	}
+	if (j.count("points"))
+		for (const auto& p : j["points"])
+			update.points.push_back(vec3FromJson(p));
+	return update;
+}
+
+CameraUpdate cameraFromJson(const Json& j)
+{
+	CameraUpdate update;
+	if (j.count("position")) {
+		update.position = vec3FromJson(j["position"]);
+		update.hasPosition = true;
+	}
+	if (j.count("viewdir")) {
+		update.viewDir = vec3FromJson(j["viewdir"]);
+		update.hasViewDir = true;
+	}
+	if (j.count("updir")) {
+		update.upDir = vec3FromJson(j["updir"]);
+		update.hasUpDir = true;
+	}
+	if (j.count("look_at")) {
+		update.lookAt = vec3FromJson(j["look_at"]);
+		update.hasLookAt = true;
+	}
+	if (j.count("fov")) {
+		update.fov = j["fov"].get<double>();
+		update.hasFov = true;
+	}
+	return update;
+}
+
+LightUpdate lightFromJson(const Json& j)
+{
+	LightUpdate update;
+	update.index = j.at("index").get<int>();
+	if (j.count("color")) {
+		update.color = vec3FromJson(j["color"]);
+		update.hasColor = true;
+	}
+	if (j.count("position")) {
+		update.position = vec3FromJson(j["position"]);
+		update.hasPosition = true;
+	}
+	if (j.count("direction")) {
+		update.direction = vec3FromJson(j["direction"]);
+		update.hasDirection = true;
+	}
+	return update;
+}
+
+// One keyframed attribute.  Values are interpolated linearly between keys
+// and held before the first and after the last one.  Keys must be added in
+// frame order.
+template <typename T>
+class Track {
+public:
+	void add(int frame, const T& value) { keys.emplace_back(frame, value); }
+	bool empty() const { return keys.empty(); }
+
+	T at(int frame) const
+	{
+		if (frame <= keys.front().first)
+			return keys.front().second;
+		for (size_t i = 1; i < keys.size(); i++) {
+			if (frame <= keys[i].first) {
+				double s = double(frame - keys[i - 1].first) /
+				           (keys[i].first - keys[i - 1].first);
+				return keys[i - 1].second * (1.0 - s) +
+				       keys[i].second * s;
+			}
+		}
+		return keys.back().second;
+	}
+
+private:
+	std::vector<std::pair<int, T>> keys;
+};
+
+struct CameraTracks {
+	Track<glm::dvec3> position, viewDir, upDir, lookAt;
+	Track<double> fov;
+
+	// Directions are keyed at unit length so that keys of different
+	// lengths don't skew the blend between them; Scene::applyFrame()
+	// normalizes the result and rejects one that passes through zero.
+	void add(int frame, const CameraUpdate& u)
+	{
+		if (u.hasPosition)
+			position.add(frame, u.position);
+		if (u.hasViewDir)
+			viewDir.add(frame, unit(u.viewDir));
+		if (u.hasUpDir)
+			upDir.add(frame, unit(u.upDir));
+		if (u.hasLookAt)
+			lookAt.add(frame, u.lookAt);
+		if (u.hasFov)
+			fov.add(frame, u.fov);
+	}
+
+	CameraUpdate at(int frame) const
+	{
+		CameraUpdate u;
+		if ((u.hasPosition = !position.empty()))
+			u.position = position.at(frame);
+		if ((u.hasViewDir = !viewDir.empty()))
+			u.viewDir = viewDir.at(frame);
+		if ((u.hasUpDir = !upDir.empty()))
+			u.upDir = upDir.at(frame);
+		if ((u.hasLookAt = !lookAt.empty()))
+			u.lookAt = lookAt.at(frame);
+		if ((u.hasFov = !fov.empty()))
+			u.fov = fov.at(frame);
+		return u;
+	}
+
+	static glm::dvec3 unit(const glm::dvec3& v)
+	{
+		double len = glm::length(v);
+		return len > 0.0 ? v / len : v;
+	}
+};
+
+struct LightTracks {
+	Track<glm::dvec3> color, position, direction;
+
+	void add(int frame, const LightUpdate& u)
+	{
+		if (u.hasColor)
+			color.add(frame, u.color);
+		if (u.hasPosition)
+			position.add(frame, u.position);
+		if (u.hasDirection)
+			direction.add(frame, u.direction);
+	}
+
+	LightUpdate at(int index, int frame) const
+	{
+		LightUpdate u;
+		u.index = index;
+		if ((u.hasColor = !color.empty()))
+			u.color = color.at(frame);
+		if ((u.hasPosition = !position.empty()))
+			u.position = position.at(frame);
+		if ((u.hasDirection = !direction.empty()))
+			u.direction = direction.at(frame);
+		return u;
+	}
+};
+
+// Later settings override earlier ones.
+void mergeCamera(CameraUpdate& into, const CameraUpdate& from)
+{
+	if (from.hasPosition) {
+		into.position = from.position;
+		into.hasPosition = true;
+	}
+	if (from.hasViewDir) {
+		into.viewDir = from.viewDir;
+		into.hasViewDir = true;
+		into.hasLookAt = false;
+	}
+	if (from.hasUpDir) {
+		into.upDir = from.upDir;
+		into.hasUpDir = true;
+	}
+	if (from.hasLookAt) {
+		into.lookAt = from.lookAt;
+		into.hasLookAt = true;
+	}
+	if (from.hasFov) {
+		into.fov = from.fov;
+		into.hasFov = true;
+	}
+}
+
+FrameUpdate frameFromJson(const Json& frame)
+{
+	FrameUpdate update;
+	if (frame.count("camera"))
+		update.camera = cameraFromJson(frame["camera"]);
+	if (frame.count("lights"))
+		for (const auto& l : frame["lights"])
+			update.lights.push_back(lightFromJson(l));
+	if (frame.count("objects"))
+		for (auto it = frame["objects"].begin();
+		     it != frame["objects"].end(); ++it)
+			update.objects.push_back(objectFromJson(it.key(), it.value()));
+	return update;
+}
+} // anonymous namespace
+
+CameraUpdate TraceUI::loadCamera(const string& text)
+{
+	return cameraFromJson(Json::parse(text));
+}
+
+// An animation lists the changes to make for each frame, keyframes for the
+// camera and lights to interpolate between, or both:
+//
+//   { "frames": [ { "objects": { "ball": { "translate": [0, 1, 0] } } },
+//                 ... ],
+//     "keys": [ { "frame": 0,  "camera": { "position": [0, 2, 8],
+//                                          "look_at": [0, 0, 0] } },
+//               { "frame": 59, "camera": { "position": [8, 2, 0] },
+//                              "lights": [ { "index": 0,
+//                                            "color": [1, 0.5, 0] } ] } ],
+//     "frame_count": 60 }
+//
+// Lights are numbered in the order they appear in the scene file.  The
+// sequence is as long as the longest of "frames", the last key and
+// "frame_count".  Explicit frames override what the keys say.
+bool TraceUI::loadAnimation(const char* file)
+{
+	std::ifstream fin(file);
+	if (!fin) {
+		std::cerr << "Couldn't read animation file " << file << std::endl;
+		return false;
+	}
+	m_frames.clear();
+	try {
+		Json json;
+		fin >> json;
+
+		std::vector<FrameUpdate> explicitFrames;
+		if (json.count("frames"))
+			for (const auto& frame : json["frames"])
+				explicitFrames.push_back(frameFromJson(frame));
+
+		std::vector<std::pair<int, FrameUpdate>> keys;
+		if (json.count("keys"))
+			for (const auto& key : json["keys"])
+				keys.emplace_back(key.at("frame").get<int>(),
+				                  frameFromJson(key));
+		std::stable_sort(keys.begin(), keys.end(),
+		                 [](const std::pair<int, FrameUpdate>& a,
+		                    const std::pair<int, FrameUpdate>& b) {
+			                 return a.first < b.first;
+		                 });
+
+		CameraTracks camera;
+		std::map<int, LightTracks> lights;
+		for (const auto& key : keys) {
+			camera.add(key.first, key.second.camera);
+			for (const auto& l : key.second.lights)
+				lights[l.index].add(key.first, l);
+		}
+
+		int count = explicitFrames.size();
+		if (!keys.empty())
+			count = std::max(count, keys.back().first + 1);
+		int frameCount = 0;
+		load(json, "frame_count", frameCount);
+		count = std::max(count, frameCount);
+
+		for (int f = 0; f < count; f++) {
+			FrameUpdate update;
+			if (!keys.empty()) {
+				update.camera = camera.at(f);
+				for (const auto& l : lights)
+					update.lights.push_back(l.second.at(l.first, f));
+			}
+			if ((size_t)f < explicitFrames.size()) {
+				const FrameUpdate& frame = explicitFrames[f];
+				mergeCamera(update.camera, frame.camera);
+				update.lights.insert(update.lights.end(),
+				                     frame.lights.begin(),
+				                     frame.lights.end());
+				update.objects = frame.objects;
+			}
+			m_frames.push_back(update);
+		}
+	} catch (Json::exception& e) {
+		std::cerr << "Bad animation file " << file << ": " << e.what()
+		          << std::endl;
+		m_frames.clear();
+		return false;
+	}
+	return true;
 }
 
 namespace {
@@ -115,7 +476,9 @@ bool TraceUI::matchCubemapFiles(const string& one_cubemap_file,
 		 */
 		bool ext_matched = false;
 		for (const auto& ext : image_exts) {
-			if (fn.find(ext) != string::npos) {
+			// At the end, so decoded copies (e.g. posx.png.mip) are skipped
+			if (fn.size() > ext.size() &&
+			    fn.compare(fn.size() - ext.size(), ext.size(), ext) == 0) {
 				std::cerr << fn << " matches " << ext  << std::endl;
 				ext_matched = true;
 				break;
@@ -164,14 +527,44 @@ void TraceUI::smartLoadCubemap(const string& file)
 		if (!getCubeMap()) {
 			setCubeMap(new CubeMap());
 		}
-		try {
+		// Decode the faces side by side, each from its .mip copy if
+		// there is one
+		std::unique_ptr<TextureMap> faces[6];
+		string errors[6];
+		{
+			ProfileScope span("cubemap load", "phase", pdir);
+			std::vector<std::thread> loaders;
 			for (int i = 0; i < 6; i++)
-				cubemap->setNthMap(i, new TextureMap(pdir + "/" + matched_fn[i]));
-		} catch (TextureMapException &xcpt) {
-			cubemap.reset();
-			std::cerr << xcpt.message() << std::endl;
-			return ;
+				loaders.emplace_back([&, i] {
+					// Anything escaping a thread would terminate the
+					// program, so every failure is passed back here
+					string name = pdir + "/" + matched_fn[i];
+					try {
+						faces[i].reset(new TextureMap(name, nullptr, true));
+					} catch (TextureMapException &xcpt) {
+						errors[i] = xcpt.message();
+					} catch (const string& msg) {
+						errors[i] = "Error loading " + name + ": " + msg;
+					} catch (const std::exception& e) {
+						errors[i] = "Error loading " + name + ": " + e.what();
+					} catch (...) {
+						errors[i] = "Error loading " + name;
+					}
+				});
+			for (auto& loader : loaders)
+				loader.join();
+		}
+		for (int i = 0; i < 6; i++) {
+			if (!errors[i].empty()) {
+				cubemap.reset();
+				m_cubeMapVersion++;
+				std::cerr << errors[i] << std::endl;
+				return ;
+			}
 		}
+		for (int i = 0; i < 6; i++)
+			cubemap->setNthMap(i, faces[i].release());
+		m_cubeMapVersion++;
 		useCubeMap(true);
 	}
 }
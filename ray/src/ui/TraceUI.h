@@ -9,6 +9,8 @@
 
 #include <string>
 #include <memory>
+#include <vector>
+#include "../scene/animation.h"
 #define MAX_THREADS 32
 
 using std::string;
@@ -40,7 +42,9 @@ public:
 	int getMaxDepth() const { return m_nTreeDepth; }
 	int getLeafSize() const { return m_nLeafSize; }
 	int getFilterWidth() const { return m_nFilterWidth; }
+	double getRebuildThreshold() const { return (double)m_nRebuildThreshold * 0.001; }
 	int getThreads() const { return m_threads; }
+	size_t getTextureBudget() const { return (size_t)m_nTextureCacheMB << 20; }
 	bool aaSwitch() const { return m_antiAlias; }
 	bool kdSwitch() const { return m_kdTree; }
 	bool shadowSw() const { return m_shadows; }
@@ -49,6 +53,8 @@ public:
 	bool cubeMap() const { return m_usingCubeMap && cubemap; }
 	CubeMap* getCubeMap() const { return cubemap.get(); }
 	void setCubeMap(CubeMap* cm);
+	// Changes whenever a different cubemap or different faces are loaded
+	unsigned int cubeMapVersion() const { return m_cubeMapVersion; }
 	bool internalReflection() const { return m_internalReflection; }
 	bool backfaceSpecular() const { return m_backfaceSpecular; }
 
@@ -89,6 +95,31 @@ public:
 		return total;
 	}
 
+	// BVH node counter, per thread like the ray counter
+	static void addNodeVisits(int number, int ctr)
+	{
+		if (ctr >= 0)
+			nodeVisits[ctr] += number;
+	}
+	static long long getNodeVisits(int ctr)
+	{
+		return ctr < 0 ? -1 : nodeVisits[ctr];
+	}
+	static long long getNodeVisits()
+	{
+		long long total = 0;
+		for (int i = 0; i < MAX_THREADS; i++)
+			total += nodeVisits[i];
+		return total;
+	}
+	static long long resetNodeVisits()
+	{
+		long long total = getNodeVisits();
+		for (int i = 0; i < MAX_THREADS; i++)
+			nodeVisits[i] = 0;
+		return total;
+	}
+
 	static int m_threads; // number of threads to run
 	static bool m_debug;
 
@@ -107,8 +138,11 @@ protected:
 	int m_nTreeDepth = 15;    // maximum kdTree depth
 	int m_nLeafSize = 10;     // target number of objects per leaf
 	int m_nFilterWidth = 1;   // width of cubemap filter
+	int m_nRebuildThreshold = 1500; // SAH cost growth (x1000) before a refit BVH is rebuilt
+	int m_nTextureCacheMB = 0; // memory for texture tiles, 0 for no limit
 
 	static int rayCount[MAX_THREADS]; // Ray counter
+	static long long nodeVisits[MAX_THREADS]; // BVH nodes tested against rays
 
 	// Determines whether or not to show debugging information
 	// for individual rays.  Disabled by default for efficiency
@@ -124,8 +158,27 @@ protected:
 	bool m_backfaceSpecular = false; // Enable specular component even seeing through the back of a translucent object.
 
 	std::unique_ptr<CubeMap> cubemap;
+	unsigned int m_cubeMapVersion = 0;
+
+	// Frames of an animation to render instead of a single image
+	std::vector<FrameUpdate> m_frames;
 
 	void loadFromJson(const char* file);
+	bool loadAnimation(const char* file);
+
+	// Settings as JSON text in the loadFromJson() format, so that they can
+	// be changed temporarily and put back.  loadSettings() throws on
+	// malformed input.
+	void loadSettings(const string& text);
+	string saveSettings();
+
+	// A camera change in the animation file format, e.g.
+	// {"position": [0, 2, 8], "look_at": [0, 0, 0]}.  Throws on malformed
+	// input.
+	static CameraUpdate loadCamera(const string& text);
+
+	template <typename F>
+	void settingFields(F field);
 	void smartLoadCubemap(const string& file);
 };
 
@@ -467,10 +467,9 @@ void DebuggingView::drawRays()
 {
 	glDisable(GL_LIGHTING);
 	// Now draw all the rays
-	for (std::vector<std::pair<ray *, isect *>>::const_iterator rayItr =
-	             raytracer->getScene().intersectCache.begin();
-	     rayItr != raytracer->getScene().intersectCache.end(); ++rayItr) {
-		switch (rayItr->first->type()) {
+	std::vector<RayRecord> rays = raytracer->getScene().getRayLog().snapshot();
+	for (const RayRecord& rec : rays) {
+		switch (rec.type) {
 			case ray::VISIBILITY:
 				if (!m_showVisibilityRays)
 					continue;
@@ -495,9 +494,10 @@ void DebuggingView::drawRays()
 				glColor4f(0.20f, 0.45f, 0.72f, 1.0f);
 				break;
 		}
-		glm::dvec3 p          = rayItr->first->getPosition();
-		glm::dvec3 d          = rayItr->first->getDirection();
-		glm::dvec3 isectPoint = p + rayItr->second->getT() * d;
+		glm::dvec3 p(rec.origin[0], rec.origin[1], rec.origin[2]);
+		glm::dvec3 d(rec.direction[0], rec.direction[1], rec.direction[2]);
+		glm::dvec3 N(rec.normal[0], rec.normal[1], rec.normal[2]);
+		glm::dvec3 isectPoint = p + double(rec.t) * d;
 
 		glEnable(GL_LINE_STIPPLE);
 		glLineStipple(1, 0x3333);
@@ -517,7 +517,7 @@ void DebuggingView::drawRays()
 			glBegin(GL_LINES);
 				glColor4f(0.5f, 1.0f, 0.5f, 1.0f);
 				glVertex3d(0.0, 0.0, 0.0);
-				glVertex3dv(&(rayItr->second->getN()[0]));
+				glVertex3dv(&N[0]);
 			glEnd();
 			glPopMatrix();
 		}
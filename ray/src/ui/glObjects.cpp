@@ -423,6 +423,11 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 	glCallList(displayList);
 }
 
+void TrimeshInstance::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+	mesh->glDrawLocal(quality, actualMaterials, actualTextures);
+}
+
 void PointLight::glDraw(GLenum lightID) const
 {
 
@@ -0,0 +1,74 @@
+// OpenGL drawing for builds without the graphical UI (RAY_GUI off).
+// The scene classes still declare glDraw(), so they get empty bodies here
+// in place of glObjects.cpp and the tracer links without any GL library.
+
+#include "../scene/scene.h"
+#include "../scene/light.h"
+
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Cone.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Torus.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+#include "../SceneObjects/trimesh.h"
+
+void Scene::glDraw(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void Geometry::glDraw(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void SceneObject::glDraw(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void Sphere::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void Box::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void Torus::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void Cone::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void Cylinder::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void Square::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void TrimeshInstance::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+}
+
+void PointLight::glDraw(unsigned int lightID) const
+{
+}
+
+void PointLight::glDraw() const
+{
+}
+
+void DirectionalLight::glDraw(unsigned int lightID) const
+{
+}
+
+void DirectionalLight::glDraw() const
+{
+}